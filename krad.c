@@ -21,162 +21,2157 @@
 #include <linux/gpio.h>
 #include <linux/interrupt.h>
 #include <linux/time.h>
+#include <linux/ktime.h>
 #include <linux/hw_random.h>
 #include <linux/spinlock.h>
 #include <linux/gfp.h>
 #include <linux/circ_buf.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/delay.h>
+#include <linux/bitops.h>
+#include <linux/percpu.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/suspend.h>
+#include <linux/random.h>
+#include <linux/string.h>
+#include <linux/timex.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/capability.h>
+#include <linux/filter.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/compat.h>
 
+#if defined(CONFIG_X86_64)
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#elif defined(CONFIG_ARM64)
+#include <asm/hwcap.h>
+#include <asm/neon.h>
+#endif
+
+#include "krad.h"
+
+/*
+ * Build profile. "make TINY=1" defines KRAD_TINY, which keeps only the
+ * pulse path and a small static buffer for constrained devices.
+ */
+#ifndef KRAD_TINY
 #define DEBUG 1
+#define KRAD_CONFIG_JITTER
+#define KRAD_CONFIG_LEDGER
+#define KRAD_CONFIG_CHARDEV
+#define KRAD_CONFIG_EXTRACT
+#define KRAD_CONFIG_TUBE2   //needs KRAD_CONFIG_EXTRACT
+#ifdef CONFIG_NET
+#define KRAD_CONFIG_BPF //classic BPF lives in the networking core
+#endif
+#endif
 
-/* Define a GPIO for the Geiger counter */
+/* Define a GPIO for the Geiger counter, or -1 if pulses are written to /dev/krad */
 static int geiger_pulse_pin = 3;
+module_param(geiger_pulse_pin, int, S_IRUGO);
+MODULE_PARM_DESC(geiger_pulse_pin, "GPIO of the geiger counter's pulse line (default 3, -1 for none)");
 
 /* the assigned IRQ for the geiger pulse pin */
 static int geiger_irq = -1;
 
-//circular buffer of random pulse times
-#define BUFFER_SIZE (PAGE_SIZE / sizeof(struct timespec))
-static struct timespec* buffer;
-static int buffer_head = 0;
-static int buffer_tail = 0;
+/*
+ * Clock used to timestamp pulses. CLOCK_REALTIME jumps with NTP, so hosts
+ * whose recordings need to be aligned should use CLOCK_TAI (steered from
+ * the PTP hardware clock by phc2sys) or CLOCK_MONOTONIC_RAW.
+ */
+static int clock_id = CLOCK_REALTIME;
+module_param(clock_id, int, S_IRUGO);
+MODULE_PARM_DESC(clock_id, "clock used to timestamp pulses: 0 = REALTIME (default), 4 = MONOTONIC_RAW, 11 = TAI");
+
+//circular buffer of random pulse times
+#ifdef KRAD_TINY
+#define BUFFER_SIZE 32UL
+static struct timespec buffer[BUFFER_SIZE];
+#else
+#define BUFFER_SIZE (PAGE_SIZE / sizeof(struct timespec))
+static struct timespec* buffer;
+#endif
+static int buffer_head = 0;
+static int buffer_tail = 0;
+static int buffer_ready = 0; //pulses up to here have been through the filter
+
+#ifdef KRAD_CONFIG_TUBE2
+/*
+ * Optional second, independent tube. Its pulses are only consumed by the
+ * inner product extractor, which needs two sources.
+ */
+static int geiger_pulse_pin2 = -1;
+module_param(geiger_pulse_pin2, int, S_IRUGO);
+MODULE_PARM_DESC(geiger_pulse_pin2, "GPIO of a second, independent geiger counter (default -1, none)");
+
+static int geiger_irq2 = -1;
+static struct timespec* buffer2;
+static int buffer2_head = 0;
+static int buffer2_tail = 0;
+static int buffer2_ready = 0;
+#else
+#define geiger_irq2 -1 //never a valid IRQ
+#endif
+
+DEFINE_SPINLOCK(producer_lock); //lock for the ISR, not that it should need one...
+DEFINE_SPINLOCK(consumer_lock); //lock for hwrng API
+
+static struct hwrng geiger_rng;
+
+/*
+ * The hwrng core's fill thread is the only kernel thread that reads us,
+ * and the only reader whose bytes are credited to the kernel's pool.
+ */
+static inline bool geiger_reader_credited(void)
+{
+    return current->flags & PF_KTHREAD;
+}
+
+#ifdef KRAD_CONFIG_JITTER
+/*
+ * CPU execution-time jitter, used to keep output flowing when the tube is
+ * quiet. Jitter words are only handed out after all buffered tube data, and
+ * are health tested separately from the tube.
+ */
+static bool jitter_fallback = false;
+module_param(jitter_fallback, bool, S_IRUGO);
+MODULE_PARM_DESC(jitter_fallback, "supplement tube data with CPU execution-time jitter (default off)");
+
+/*
+ * Jitter words are never handed to the hwrng core's fill thread, so they
+ * don't dilute the tube's credit. With a non-zero jitter_quality, words
+ * that /dev/hwrng readers leave behind go straight to the kernel's pool
+ * at this credit instead.
+ */
+static int jitter_quality = 0;
+module_param(jitter_quality, int, S_IRUGO);
+MODULE_PARM_DESC(jitter_quality, "entropy credit per 1024 jitter bits fed to the kernel's pool (default 0, not fed)");
+
+//circular buffer of folded jitter words, filled by the jitter thread
+#define JITTER_SIZE 64
+static u32 jitter_buffer[JITTER_SIZE];
+static int jitter_head = 0;
+static int jitter_tail = 0;
+static struct task_struct* jitter_task;
+static u8* jitter_mem;
+
+/*
+ * Set by the PM notifier. The thread isn't freezable, because
+ * add_hwgenerator_randomness() waits for the pool in a sleep the freezer
+ * can't break, so it idles through suspend on these instead.
+ */
+static int jitter_suspended = 0;
+static int jitter_resumed = 0;
+
+#define JITTER_FOLD        32   //samples folded into each output word
+#define JITTER_STARTUP     1024 //samples that must pass before any output
+#define JITTER_RCT_CUTOFF  31   //repetition count test, H >= 1 bit, alpha = 2^-30
+#define JITTER_APT_WINDOW  512  //adaptive proportion test window
+#define JITTER_APT_CUTOFF  410  //adaptive proportion test cutoff for H >= 1 bit
+#define JITTER_IDLE_MS     10   //nap while the jitter buffer is full
+#define JITTER_RECHECK     64   //samples that must pass after resume
+#define JITTER_RESTARTS    16   //health failures in a row before giving up
+#define JITTER_MEM_SIZE    (1024 * 1024) //bigger than the L2 of the SoCs krad runs on
+#define JITTER_MEM_STRIDE  4099 //a new cache line and page on every access
+#define JITTER_TIMER_TESTS 256  //samples timed to check the timer at start
+#define JITTER_POOL_WORDS  8    //words per batch fed to the kernel's pool
+#endif
+
+#ifdef KRAD_CONFIG_LEDGER
+/*
+ * Ledger of entropy coming in from the tube and going out to consumers,
+ * kept per-CPU and summed in /sys/module/krad/ledger
+ */
+struct krad_ledger
+{
+    u64 samples_in;      //pulses captured by the ISR
+    u64 samples_dropped; //pulses lost to a full buffer
+    u64 samples_filtered; //pulses dropped by the BPF filter
+    u64 estimated_bits;  //estimated min-entropy of the captured pulses
+    u64 jitter_words_in; //words produced by the jitter source
+    u64 credited_bits;   //bits the hwrng core credited to the kernel pool
+    u64 hwrng_bits;      //bits read by the hwrng core's fill thread
+    u64 dev_hwrng_bits;  //bits read through /dev/hwrng
+    u64 data_read_bits;  //bits read through the old data_read API
+    u64 filter_tags[KRAD_FILTER_TAGS]; //pulses the BPF filter kept, by tag
+};
+
+static DEFINE_PER_CPU(struct krad_ledger, krad_ledger);
+static struct kobject* ledger_kobj;
+
+#define ledger_add(field, n) this_cpu_add(krad_ledger.field, (n))
+#else
+#define ledger_add(field, n) do { } while(0)
+#endif
+
+#ifdef KRAD_CONFIG_LEDGER
+/*
+ * Timing resolution assumed by the min-entropy estimate. The clock itself
+ * is finer than this, but interrupt latency smears pulses over about a
+ * microsecond.
+ */
+static unsigned int resolution_ns = 1000;
+module_param(resolution_ns, uint, S_IRUGO);
+MODULE_PARM_DESC(resolution_ns, "effective pulse timing resolution used to estimate min-entropy (default 1000)");
+
+//interval baselines for the min-entropy estimate, guarded by producer_lock
+struct geiger_interval
+{
+    struct timespec last_pulse;
+    u64 mean_interval_ns;
+};
+
+static struct geiger_interval intervals[2];
+#endif
+
+#ifdef KRAD_CONFIG_EXTRACT
+/*
+ * Optional extractor run over the pulse stream. "none" hands out raw
+ * timestamps, "toeplitz" compresses the low 32 bits of 8 pulses into
+ * 64 nearly uniform bits with a seeded Toeplitz hash, and "inner"
+ * combines two independent tubes with an inner product extractor.
+ */
+static char* extractor = "none";
+module_param(extractor, charp, S_IRUGO);
+MODULE_PARM_DESC(extractor, "pulse extractor: none (default), toeplitz or inner (needs geiger_pulse_pin2)");
+
+static bool extractor_bench = false;
+module_param(extractor_bench, bool, S_IRUGO);
+MODULE_PARM_DESC(extractor_bench, "log the extractor's nanoseconds per output byte at load");
+
+enum geiger_extractor
+{
+    EXTRACT_NONE,
+    EXTRACT_TOEPLITZ,
+    EXTRACT_INNER,
+};
+
+static enum geiger_extractor extract_mode = EXTRACT_NONE;
+
+#define TOEPLITZ_PULSES     8  //pulses per block, 32 bits from each
+#define TOEPLITZ_IN_WORDS   4  //n = 256 input bits
+#define TOEPLITZ_SEED_WORDS 5  //n + m - 1 = 319 seed bits, rounded up
+#define TOEPLITZ_BATCH      8  //blocks extracted per FPU section
+
+static u64 toeplitz_seed[TOEPLITZ_SEED_WORDS];
+static bool toeplitz_accel = false;
+
+#ifdef KRAD_CONFIG_TUBE2
+/*
+ * The inner product works over n = 269 bit vectors. n is prime and 2 is a
+ * primitive root mod n, so the cyclic shifts used to get more than one
+ * output bit per block keep the extractor's guarantee.
+ */
+#define INNER_PULSES    9   //pulses per block from each tube, 30 bits from the first 8, 29 from the last
+#define INNER_BITS      269
+#define INNER_WORDS     DIV_ROUND_UP(INNER_BITS, 64)
+#define INNER_TOP_MASK  ((1ULL << (INNER_BITS % 64)) - 1)
+#define INNER_OUT_BITS  32  //output bits per block
+#endif
+
+//extracted bytes not yet handed out, guarded by consumer_lock
+static u8 extract_pool[sizeof(u64)];
+static unsigned int extract_pool_len = 0;
+#endif
+
+#ifdef KRAD_CONFIG_JITTER
+/*
+ * Health test state for the jitter source
+ */
+struct jitter_health
+{
+    u64 last_delta;
+    u64 last_delta2;
+    u64 rct_value;
+    int rct_count;
+    u64 apt_value;
+    int apt_count;
+    int apt_seen;
+    int startup;
+};
+
+/*
+ * Times a cache-unfriendly walk over jitter_mem with the finest counter
+ * the CPU has, as jitterentropy does. The variation in how long it takes
+ * is the entropy source.
+ */
+static u64 geiger_jitter_measure(void)
+{
+    static unsigned int jitter_pos;
+    cycles_t start;
+    cycles_t end;
+    int i;
+
+    start = random_get_entropy();
+
+    for(i = 0; i < 64; i++)
+    {
+        jitter_pos = (jitter_pos + JITTER_MEM_STRIDE) & (JITTER_MEM_SIZE - 1);
+        jitter_mem[jitter_pos] += (u8) start + i;
+    }
+
+    end = random_get_entropy();
+
+    return (cycles_t) (end - start);
+}
+
+/*
+ * The health tests can't tell a coarse timer from a failed source, so
+ * check up front that the timer resolves single samples. Some ARM SoCs
+ * only have a 1 MHz timer, which mostly reads the same tick twice.
+ */
+static bool geiger_jitter_timer_ok(void)
+{
+    u64 last = 0;
+    int stuck = 0;
+    int i;
+
+    for(i = 0; i < JITTER_TIMER_TESTS; i++)
+    {
+        u64 delta = geiger_jitter_measure();
+
+        if(!delta)
+            return false;
+
+        if(delta == last)
+            stuck++;
+
+        last = delta;
+    }
+
+    return stuck < JITTER_TIMER_TESTS * 9 / 10;
+}
+
+static void geiger_jitter_reset(struct jitter_health* h)
+{
+    memset(h, 0, sizeof(*h));
+    h->startup = JITTER_STARTUP;
+}
+
+/*
+ * Runs the stuck, repetition count and adaptive proportion tests on a
+ * sample. Returns 1 if the sample may be used, 0 if it should be dropped,
+ * or -EIO if the source has failed.
+ */
+static int geiger_jitter_health(struct jitter_health* h, u64 delta)
+{
+    u64 delta2 = delta - h->last_delta;
+    u64 delta3 = delta2 - h->last_delta2;
+    int stuck = (!delta || !delta2 || !delta3);
+
+    h->last_delta = delta;
+    h->last_delta2 = delta2;
+
+    //repetition count test
+    if(delta == h->rct_value)
+    {
+        if(++h->rct_count >= JITTER_RCT_CUTOFF)
+            return -EIO;
+    }
+    else
+    {
+        h->rct_value = delta;
+        h->rct_count = 1;
+    }
+
+    //adaptive proportion test
+    if(h->apt_seen == 0)
+    {
+        h->apt_value = delta;
+        h->apt_count = 0;
+    }
+
+    if(delta == h->apt_value && ++h->apt_count >= JITTER_APT_CUTOFF)
+        return -EIO;
+
+    if(++h->apt_seen >= JITTER_APT_WINDOW)
+        h->apt_seen = 0;
+
+    if(stuck)
+        return 0;
+
+    if(h->startup)
+    {
+        h->startup--;
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Low priority thread that keeps the jitter buffer topped up
+ */
+static int geiger_jitter_thread(void* data)
+{
+    struct jitter_health health;
+    u32 pool[JITTER_POOL_WORDS];
+    int pooled = 0;
+    int restarts = 0;
+    u32 word = 0;
+    int folded = 0;
+
+    set_user_nice(current, 19);
+    geiger_jitter_reset(&health);
+
+    while(!kthread_should_stop())
+    {
+        int head;
+        int tail;
+        u64 delta;
+        int ret;
+
+        if(xchg(&jitter_resumed, 0))
+        {
+            //back from suspend, keep the buffer but re-test before adding to it
+            geiger_jitter_reset(&health);
+            health.startup = JITTER_RECHECK;
+            pooled = 0;
+            word = 0;
+            folded = 0;
+        }
+
+        if(restarts >= JITTER_RESTARTS)
+        {
+            //failed for good, idle until unload
+            schedule_timeout_interruptible(HZ);
+            continue;
+        }
+
+        if(smp_load_acquire(&jitter_suspended))
+        {
+            msleep_interruptible(JITTER_IDLE_MS);
+            continue;
+        }
+
+        head = jitter_head;
+        tail = smp_load_acquire(&jitter_tail);
+
+        if(CIRC_SPACE(head, tail, JITTER_SIZE) < 1 && !jitter_quality)
+        {
+            msleep_interruptible(JITTER_IDLE_MS);
+            continue;
+        }
+
+        delta = geiger_jitter_measure();
+        ret = geiger_jitter_health(&health, delta);
+
+        if(ret < 0)
+        {
+            if(++restarts >= JITTER_RESTARTS)
+                printk(KERN_ERR "krad: jitter source keeps failing health tests, disabling it\n");
+            else
+                printk_ratelimited(KERN_WARNING "krad: jitter source failed health test, restarting\n");
+
+            //throw away everything gathered since the last good test
+            spin_lock(&consumer_lock);
+            smp_store_release(&jitter_tail, head);
+            spin_unlock(&consumer_lock);
+            geiger_jitter_reset(&health);
+            pooled = 0;
+            word = 0;
+            folded = 0;
+            continue;
+        }
+
+        if(ret > 0)
+        {
+            word = rol32(word, 5) ^ (u32) delta;
+
+            if(++folded == JITTER_FOLD)
+            {
+                ledger_add(jitter_words_in, 1);
+                restarts = 0;
+                folded = 0;
+
+                if(CIRC_SPACE(head, tail, JITTER_SIZE) >= 1)
+                {
+                    jitter_buffer[head] = word;
+                    smp_store_release(&jitter_head, (head + 1) & (JITTER_SIZE - 1));
+                }
+                else
+                {
+                    //nobody is reading /dev/hwrng, and jitter_quality is set
+                    pool[pooled++] = word;
+
+                    if(pooled == JITTER_POOL_WORDS)
+                    {
+                        size_t bits = (sizeof(pool) * 8 * jitter_quality) >> 10;
+
+                        //blocks until the pool wants more
+                        add_hwgenerator_randomness((const char*) pool, sizeof(pool), bits);
+                        ledger_add(credited_bits, bits);
+                        pooled = 0;
+                    }
+                }
+            }
+        }
+
+        cond_resched();
+    }
+
+    return 0;
+}
+
+/*
+ * Number of jitter words ready for consumers. Call with consumer_lock held.
+ */
+static int geiger_jitter_count(void)
+{
+    if(!jitter_fallback || geiger_reader_credited())
+        return 0;
+
+    return CIRC_CNT(smp_load_acquire(&jitter_head), jitter_tail, JITTER_SIZE);
+}
+
+/*
+ * Copies whole jitter words into data. Call with consumer_lock held.
+ */
+static size_t geiger_jitter_read(u8* data, size_t max)
+{
+    int head;
+    int tail;
+    size_t w;
+    size_t words_given;
+
+    if(!jitter_fallback || geiger_reader_credited())
+        return 0;
+
+    head = smp_load_acquire(&jitter_head);
+    tail = jitter_tail;
+
+    words_given = min(max / sizeof(u32),
+                      (size_t) CIRC_CNT(head, tail, JITTER_SIZE));
+
+    for(w = 0; w < words_given; w++)
+    {
+        memcpy(data + w * sizeof(u32), &jitter_buffer[tail], sizeof(u32));
+        tail = (tail + 1) & (JITTER_SIZE - 1);
+    }
+
+    smp_store_release(&jitter_tail, tail);
+
+    return words_given * sizeof(u32);
+}
+
+static int geiger_jitter_start(void)
+{
+    if(!jitter_fallback)
+        return 0;
+
+    jitter_quality = clamp(jitter_quality, 0, 1024);
+    jitter_mem = vzalloc(JITTER_MEM_SIZE);
+
+    if(!jitter_mem)
+    {
+        printk(KERN_ERR "krad: Not enough memory for the jitter source\n");
+        return -ENOMEM;
+    }
+
+    if(!geiger_jitter_timer_ok())
+    {
+        printk(KERN_WARNING "krad: CPU timer is too coarse for the jitter source, disabling jitter_fallback\n");
+        vfree(jitter_mem);
+        jitter_fallback = false;
+        return 0;
+    }
+
+    jitter_task = kthread_run(geiger_jitter_thread, NULL, "krad_jitter");
+
+    if(IS_ERR(jitter_task))
+    {
+        printk(KERN_ERR "krad: Unable to start jitter thread: %ld\n", PTR_ERR(jitter_task));
+        vfree(jitter_mem);
+        return PTR_ERR(jitter_task);
+    }
+
+    return 0;
+}
+
+static void geiger_jitter_stop(void)
+{
+    if(!jitter_fallback)
+        return;
+
+    kthread_stop(jitter_task);
+    vfree(jitter_mem);
+}
+
+static void geiger_jitter_suspend(void)
+{
+    smp_store_release(&jitter_suspended, 1);
+}
+
+//the thread re-runs a short health check before it produces again
+static void geiger_jitter_resume(void)
+{
+    xchg(&jitter_resumed, 1);
+    smp_store_release(&jitter_suspended, 0);
+}
+#else
+static int geiger_jitter_count(void) { return 0; }
+static size_t geiger_jitter_read(u8* data, size_t max) { return 0; }
+static int geiger_jitter_start(void) { return 0; }
+static void geiger_jitter_stop(void) { }
+static void geiger_jitter_suspend(void) { }
+static void geiger_jitter_resume(void) { }
+#endif
+
+#ifdef KRAD_CONFIG_LEDGER
+/*
+ * Estimates the min-entropy of a pulse. For exponentially distributed
+ * intervals timed at resolution r, the likeliest outcome has probability
+ * of about r / mean, so H_min ~= log2(mean / r). The mean is a running
+ * average with a weight of 1/8. Call with producer_lock held.
+ */
+static unsigned int geiger_estimate_entropy(struct geiger_interval* iv, const struct timespec* t)
+{
+    s64 interval;
+
+    if(!iv->last_pulse.tv_sec && !iv->last_pulse.tv_nsec)
+    {
+        iv->last_pulse = *t;
+        return 0;
+    }
+
+    interval = timespec_to_ns(t) - timespec_to_ns(&iv->last_pulse);
+    iv->last_pulse = *t;
+
+    if(interval <= 0)
+        return 0;
+
+    if(!iv->mean_interval_ns)
+        iv->mean_interval_ns = interval;
+    else
+        iv->mean_interval_ns = iv->mean_interval_ns - (iv->mean_interval_ns >> 3) + (interval >> 3);
+
+    if(iv->mean_interval_ns < 2 * (u64) resolution_ns)
+        return 0;
+
+    //tv_nsec never holds more than 30 bits
+    return min(ilog2(div64_u64(iv->mean_interval_ns, resolution_ns)), 30);
+}
+
+/*
+ * Accounts for bytes handed to a consumer
+ */
+static void geiger_ledger_deliver(size_t bytes, bool legacy)
+{
+    u64 bits = (u64) bytes * 8;
+
+    if(!bits)
+        return;
+
+    if(legacy)
+    {
+        ledger_add(data_read_bits, bits);
+    }
+    else if(geiger_reader_credited())
+    {
+        /*
+         * The core credits rng->quality, or its default_quality when that
+         * is 0. krad always sets a non-zero quality, so this matches the
+         * core unless root overrides rng_core's current_quality parameter
+         * at runtime, which the ledger can't see.
+         */
+        ledger_add(hwrng_bits, bits);
+        ledger_add(credited_bits, (bits * geiger_rng.quality) >> 10);
+    }
+    else
+    {
+        ledger_add(dev_hwrng_bits, bits);
+    }
+}
+
+static u64 geiger_ledger_sum(size_t offset)
+{
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        sum += *(u64*) ((u8*) per_cpu_ptr(&krad_ledger, cpu) + offset);
+
+    return sum;
+}
+
+#define LEDGER_ATTR(field)                                                                    \
+static ssize_t field##_show(struct kobject* kobj, struct kobj_attribute* attr, char* buf)    \
+{                                                                                             \
+    return sprintf(buf, "%llu\n", geiger_ledger_sum(offsetof(struct krad_ledger, field)));   \
+}                                                                                             \
+static struct kobj_attribute field##_attr = __ATTR_RO(field)
+
+LEDGER_ATTR(samples_in);
+LEDGER_ATTR(samples_dropped);
+LEDGER_ATTR(samples_filtered);
+LEDGER_ATTR(estimated_bits);
+LEDGER_ATTR(jitter_words_in);
+LEDGER_ATTR(credited_bits);
+LEDGER_ATTR(hwrng_bits);
+LEDGER_ATTR(dev_hwrng_bits);
+LEDGER_ATTR(data_read_bits);
+
+static ssize_t filter_tags_show(struct kobject* kobj, struct kobj_attribute* attr, char* buf)
+{
+    ssize_t len = 0;
+    int tag;
+
+    for(tag = 0; tag < KRAD_FILTER_TAGS; tag++)
+    {
+        u64 count = geiger_ledger_sum(offsetof(struct krad_ledger, filter_tags[tag]));
+
+        len += sprintf(buf + len, "%llu%c", count, tag == KRAD_FILTER_TAGS - 1 ? '\n' : ' ');
+    }
+
+    return len;
+}
+static struct kobj_attribute filter_tags_attr = __ATTR_RO(filter_tags);
+
+static struct attribute* ledger_attrs[] = {
+    &samples_in_attr.attr,
+    &samples_dropped_attr.attr,
+    &samples_filtered_attr.attr,
+    &estimated_bits_attr.attr,
+    &jitter_words_in_attr.attr,
+    &credited_bits_attr.attr,
+    &hwrng_bits_attr.attr,
+    &dev_hwrng_bits_attr.attr,
+    &data_read_bits_attr.attr,
+    &filter_tags_attr.attr,
+    NULL
+};
+
+static struct attribute_group ledger_group = {
+    .attrs = ledger_attrs,
+};
+
+static int geiger_ledger_init(void)
+{
+    int ret;
+
+    if(!resolution_ns)
+    {
+        printk(KERN_ERR "krad: resolution_ns must be at least 1\n");
+        return -EINVAL;
+    }
+
+    ledger_kobj = kobject_create_and_add("ledger", &THIS_MODULE->mkobj.kobj);
+
+    if(!ledger_kobj)
+    {
+        printk(KERN_ERR "krad: Unable to create ledger in sysfs\n");
+        return -ENOMEM;
+    }
+
+    ret = sysfs_create_group(ledger_kobj, &ledger_group);
+
+    if(ret)
+    {
+        printk(KERN_ERR "krad: Unable to populate ledger in sysfs: %d\n", ret);
+        kobject_put(ledger_kobj);
+        return ret;
+    }
+
+    return 0;
+}
+
+static void geiger_ledger_exit(void)
+{
+    kobject_put(ledger_kobj);
+}
+
+//forget the interval baselines. Call with producer_lock held.
+static void geiger_ledger_restart(void)
+{
+    int i;
+
+    for(i = 0; i < ARRAY_SIZE(intervals); i++)
+    {
+        intervals[i].last_pulse.tv_sec = 0;
+        intervals[i].last_pulse.tv_nsec = 0;
+    }
+}
+#else
+static void geiger_ledger_deliver(size_t bytes, bool legacy) { }
+static int geiger_ledger_init(void) { return 0; }
+static void geiger_ledger_exit(void) { }
+static void geiger_ledger_restart(void) { }
+#endif
+
+#ifdef KRAD_CONFIG_EXTRACT
+/*
+ * Carry-less 64x64 -> 128 bit multiply, constant time
+ */
+static inline void geiger_clmul_generic(u64 a, u64 b, u64* lo, u64* hi)
+{
+    u64 l = 0;
+    u64 h = 0;
+    int i;
+
+    for(i = 0; i < 64; i++)
+    {
+        u64 mask = -((b >> i) & 1);
+
+        l ^= (a << i) & mask;
+        h ^= (i ? a >> (64 - i) : 0) & mask;
+    }
+
+    *lo = l;
+    *hi = h;
+}
+
+#if defined(CONFIG_X86_64)
+static inline void geiger_clmul_accel(u64 a, u64 b, u64* lo, u64* hi)
+{
+    asm("movq %2, %%xmm0\n\t"
+        "movq %3, %%xmm1\n\t"
+        "pclmulqdq $0x00, %%xmm1, %%xmm0\n\t"
+        "movq %%xmm0, %0\n\t"
+        "psrldq $8, %%xmm0\n\t"
+        "movq %%xmm0, %1"
+        : "=r" (*lo), "=r" (*hi)
+        : "r" (a), "r" (b)
+        : "xmm0", "xmm1");
+}
+
+static bool __init geiger_clmul_usable(void)
+{
+    return boot_cpu_has(X86_FEATURE_PCLMULQDQ);
+}
+
+#define geiger_clmul_begin() kernel_fpu_begin()
+#define geiger_clmul_end()   kernel_fpu_end()
+#elif defined(CONFIG_ARM64)
+static inline void geiger_clmul_accel(u64 a, u64 b, u64* lo, u64* hi)
+{
+    asm("fmov d0, %2\n\t"
+        "fmov d1, %3\n\t"
+        ".inst 0x0ee1e000\n\t" //pmull v0.1q, v0.1d, v1.1d
+        "fmov %0, d0\n\t"
+        "mov %1, v0.d[1]"
+        : "=r" (*lo), "=r" (*hi)
+        : "r" (a), "r" (b)
+        : "v0", "v1");
+}
+
+static bool __init geiger_clmul_usable(void)
+{
+    return elf_hwcap & HWCAP_PMULL;
+}
+
+#define geiger_clmul_begin() kernel_neon_begin()
+#define geiger_clmul_end()   kernel_neon_end()
+#else
+#define geiger_clmul_accel   geiger_clmul_generic
+#define geiger_clmul_usable() false
+#define geiger_clmul_begin() do { } while(0)
+#define geiger_clmul_end()   do { } while(0)
+#endif
+
+/*
+ * Multiplies a 256 bit block by the 64x256 Toeplitz matrix defined by the
+ * seed. Over GF(2) this is bits 255..318 of the carry-less product of the
+ * seed and the block, so only the partial products landing in words 3 and
+ * 4 of the result are needed.
+ */
+static __always_inline u64 geiger_toeplitz_block(const u64* x, bool accel)
+{
+    u64 w3 = 0;
+    u64 w4 = 0;
+    u64 lo;
+    u64 hi;
+    int k;
+    int l;
+
+    for(k = 0; k < TOEPLITZ_IN_WORDS; k++)
+    {
+        for(l = 0; l < TOEPLITZ_SEED_WORDS; l++)
+        {
+            int w = k + l;
+
+            if(w < 2 || w > 4)
+                continue;
+
+            if(accel)
+                geiger_clmul_accel(x[k], toeplitz_seed[l], &lo, &hi);
+            else
+                geiger_clmul_generic(x[k], toeplitz_seed[l], &lo, &hi);
+
+            if(w == 2)
+            {
+                w3 ^= hi;
+            }
+            else if(w == 3)
+            {
+                w3 ^= lo;
+                w4 ^= hi;
+            }
+            else
+            {
+                w4 ^= lo;
+            }
+        }
+    }
+
+    return (w3 >> 63) | (w4 << 1);
+}
+
+static void geiger_toeplitz(const u64* in, u64* out, size_t blocks, bool accel)
+{
+    size_t b;
+
+    if(accel)
+    {
+        geiger_clmul_begin();
+
+        for(b = 0; b < blocks; b++)
+            out[b] = geiger_toeplitz_block(in + b * TOEPLITZ_IN_WORDS, true);
+
+        geiger_clmul_end();
+    }
+    else
+    {
+        for(b = 0; b < blocks; b++)
+            out[b] = geiger_toeplitz_block(in + b * TOEPLITZ_IN_WORDS, false);
+    }
+}
+
+#endif
+
+#ifdef KRAD_CONFIG_BPF
+/*
+ * Optional classic BPF pulse filter, loaded through /dev/krad. Programs
+ * are checked and converted (and JIT compiled, if the JIT is on) by the
+ * kernel's BPF core, then run on each batch of pulses captured since the
+ * last read.
+ */
+static struct bpf_prog* filter_prog; //guarded by consumer_lock
+static struct timespec filter_last[2];
+
+#define FILTER_DROPPED NSEC_PER_SEC //never a valid tv_nsec
+
+/*
+ * Restricts programs to loads from struct krad_pulse_data, turning packet
+ * loads into context loads like seccomp does
+ */
+static int geiger_filter_check(struct sock_filter* filter, unsigned int flen)
+{
+    unsigned int pc;
+
+    for(pc = 0; pc < flen; pc++)
+    {
+        struct sock_filter* f = &filter[pc];
+
+        switch(f->code)
+        {
+            case BPF_LD | BPF_W | BPF_ABS:
+                if(f->k >= sizeof(struct krad_pulse_data) || f->k & 3)
+                    return -EINVAL;
+                f->code = BPF_LDX | BPF_W | BPF_ABS;
+                break;
+            case BPF_LD | BPF_W | BPF_LEN:
+                f->code = BPF_LD | BPF_IMM;
+                f->k = sizeof(struct krad_pulse_data);
+                break;
+            case BPF_LDX | BPF_W | BPF_LEN:
+                f->code = BPF_LDX | BPF_IMM;
+                f->k = sizeof(struct krad_pulse_data);
+                break;
+            //everything else in classic BPF, minus packet access and extensions
+            case BPF_RET | BPF_K:
+            case BPF_RET | BPF_A:
+            case BPF_ALU | BPF_ADD | BPF_K:
+            case BPF_ALU | BPF_ADD | BPF_X:
+            case BPF_ALU | BPF_SUB | BPF_K:
+            case BPF_ALU | BPF_SUB | BPF_X:
+            case BPF_ALU | BPF_MUL | BPF_K:
+            case BPF_ALU | BPF_MUL | BPF_X:
+            case BPF_ALU | BPF_DIV | BPF_K:
+            case BPF_ALU | BPF_DIV | BPF_X:
+            case BPF_ALU | BPF_AND | BPF_K:
+            case BPF_ALU | BPF_AND | BPF_X:
+            case BPF_ALU | BPF_OR | BPF_K:
+            case BPF_ALU | BPF_OR | BPF_X:
+            case BPF_ALU | BPF_XOR | BPF_K:
+            case BPF_ALU | BPF_XOR | BPF_X:
+            case BPF_ALU | BPF_LSH | BPF_K:
+            case BPF_ALU | BPF_LSH | BPF_X:
+            case BPF_ALU | BPF_RSH | BPF_K:
+            case BPF_ALU | BPF_RSH | BPF_X:
+            case BPF_ALU | BPF_NEG:
+            case BPF_LD | BPF_IMM:
+            case BPF_LDX | BPF_IMM:
+            case BPF_MISC | BPF_TAX:
+            case BPF_MISC | BPF_TXA:
+            case BPF_LD | BPF_MEM:
+            case BPF_LDX | BPF_MEM:
+            case BPF_ST:
+            case BPF_STX:
+            case BPF_JMP | BPF_JA:
+            case BPF_JMP | BPF_JEQ | BPF_K:
+            case BPF_JMP | BPF_JEQ | BPF_X:
+            case BPF_JMP | BPF_JGE | BPF_K:
+            case BPF_JMP | BPF_JGE | BPF_X:
+            case BPF_JMP | BPF_JGT | BPF_K:
+            case BPF_JMP | BPF_JGT | BPF_X:
+            case BPF_JMP | BPF_JSET | BPF_K:
+            case BPF_JMP | BPF_JSET | BPF_X:
+                continue;
+            default:
+                return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Replaces the filter, or removes it if fprog is NULL. fprog has already
+ * been copied in, but its instructions are still in userspace.
+ */
+static int geiger_filter_attach(struct sock_fprog* fprog)
+{
+    struct bpf_prog* prog = NULL;
+    struct bpf_prog* old;
+    int ret;
+
+    if(!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+
+    if(fprog)
+    {
+        ret = bpf_prog_create_from_user(&prog, fprog, geiger_filter_check, false);
+
+        if(ret)
+            return ret;
+    }
+
+    spin_lock(&consumer_lock);
+    old = filter_prog;
+    filter_prog = prog;
+    spin_unlock(&consumer_lock);
+
+    if(old)
+        bpf_prog_destroy(old);
+
+    return 0;
+}
+
+/*
+ * The PM notifier may still run the filter, so unpublish it before
+ * freeing it
+ */
+static void geiger_filter_exit(void)
+{
+    struct bpf_prog* prog;
+
+    spin_lock(&consumer_lock);
+    prog = filter_prog;
+    filter_prog = NULL;
+    spin_unlock(&consumer_lock);
+
+    if(prog)
+        bpf_prog_destroy(prog);
+}
+
+//forget the interval baselines. Call with consumer_lock held.
+static void geiger_filter_restart(void)
+{
+    memset(filter_last, 0, sizeof(filter_last));
+}
+
+/*
+ * Runs the filter over pulses that arrived since the last batch, then
+ * squeezes dropped pulses out by shifting everything older towards head.
+ * The ISR only ever writes at head, so the whole span from tail to head
+ * is ours to rearrange. Call with consumer_lock held.
+ */
+static void geiger_filter_ring(struct timespec* ring, int* ring_head, int* ring_tail, int* ring_ready, int tube)
+{
+    int head = smp_load_acquire(ring_head);
+    int tail = *ring_tail;
+    struct timespec prev;
+    int dropped = 0;
+    int i;
+    int w;
+
+    if(!filter_prog || *ring_ready == head)
+    {
+        *ring_ready = head;
+        return;
+    }
+
+    prev = filter_last[tube];
+
+    for(i = *ring_ready; i != head; i = (i + 1) & (BUFFER_SIZE - 1))
+    {
+        struct krad_pulse_data ctx;
+        u32 ret;
+
+        ctx.tv_sec = (u32) ring[i].tv_sec;
+        ctx.tv_nsec = (u32) ring[i].tv_nsec;
+        ctx.interval_ns = 0;
+        ctx.tube = tube;
+
+        if(prev.tv_sec || prev.tv_nsec)
+            ctx.interval_ns = clamp_t(s64, timespec_to_ns(&ring[i]) - timespec_to_ns(&prev), 0, U32_MAX);
+
+        prev = ring[i];
+        ret = BPF_PROG_RUN(filter_prog, &ctx);
+
+        if(ret == KRAD_FILTER_DROP)
+        {
+            ring[i].tv_nsec = FILTER_DROPPED;
+            dropped++;
+        }
+        else if(ret < KRAD_FILTER_TAGS)
+        {
+            ledger_add(filter_tags[ret], 1);
+        }
+    }
+
+    filter_last[tube] = prev;
+
+    if(dropped)
+    {
+        w = head;
+
+        for(i = head; i != tail; )
+        {
+            i = (i - 1) & (BUFFER_SIZE - 1);
+
+            if(ring[i].tv_nsec == FILTER_DROPPED)
+                continue;
+
+            w = (w - 1) & (BUFFER_SIZE - 1);
+            ring[w] = ring[i];
+        }
+
+        smp_store_release(ring_tail, w);
+        ledger_add(samples_filtered, dropped);
+    }
+
+    *ring_ready = head;
+}
+#else
+static inline int geiger_filter_attach(struct sock_fprog* fprog) { return -EOPNOTSUPP; }
+static void geiger_filter_exit(void) { }
+static void geiger_filter_restart(void) { }
+
+static void geiger_filter_ring(struct timespec* ring, int* ring_head, int* ring_tail, int* ring_ready, int tube)
+{
+    *ring_ready = smp_load_acquire(ring_head);
+}
+#endif
+
+/*
+ * Brings the pulses consumers may see up to date. Call with consumer_lock
+ * held.
+ */
+static void geiger_filter_run(void)
+{
+    geiger_filter_ring(buffer, &buffer_head, &buffer_tail, &buffer_ready, 0);
+
+#ifdef KRAD_CONFIG_TUBE2
+    if(buffer2)
+        geiger_filter_ring(buffer2, &buffer2_head, &buffer2_tail, &buffer2_ready, 1);
+#endif
+}
+
+#ifdef KRAD_CONFIG_EXTRACT
+/*
+ * Copies extracted output into data, keeping whatever doesn't fit in the
+ * pool for the next read. Call with consumer_lock held.
+ */
+static size_t geiger_pool_put(u8* data, size_t max, const void* out, size_t len)
+{
+    size_t n = min(len, max);
+
+    memcpy(data, out, n);
+
+    if(n < len)
+    {
+        extract_pool_len = len - n;
+        memcpy(extract_pool + sizeof(extract_pool) - extract_pool_len,
+               (const u8*) out + n, extract_pool_len);
+    }
+
+    return n;
+}
+
+//hands out what the last short read left behind. Call with consumer_lock held.
+static size_t geiger_pool_get(u8* data, size_t max)
+{
+    size_t n = min((size_t) extract_pool_len, max);
+
+    memcpy(data, extract_pool + sizeof(extract_pool) - extract_pool_len, n);
+    extract_pool_len -= n;
+
+    return n;
+}
+
+/*
+ * Runs buffered pulses through the Toeplitz extractor, 8 pulses per 8
+ * output bytes. Call with consumer_lock held.
+ */
+static size_t geiger_toeplitz_read(u8* data, size_t max)
+{
+    u64 in[TOEPLITZ_BATCH * TOEPLITZ_IN_WORDS];
+    u64 out[TOEPLITZ_BATCH];
+    size_t bytes = 0;
+    int head;
+    int tail;
+
+    head = buffer_ready;
+    tail = buffer_tail;
+
+    while(bytes < max && CIRC_CNT(head, tail, BUFFER_SIZE) >= TOEPLITZ_PULSES)
+    {
+        size_t blocks = min3(DIV_ROUND_UP(max - bytes, sizeof(u64)),
+                             (size_t) CIRC_CNT(head, tail, BUFFER_SIZE) / TOEPLITZ_PULSES,
+                             (size_t) TOEPLITZ_BATCH);
+        size_t w;
+
+        for(w = 0; w < blocks * TOEPLITZ_IN_WORDS; w++)
+        {
+            u64 lo = (u32) buffer[tail].tv_nsec;
+            u64 hi = (u32) buffer[(tail + 1) & (BUFFER_SIZE - 1)].tv_nsec;
+
+            in[w] = lo | (hi << 32);
+            tail = (tail + 2) & (BUFFER_SIZE - 1);
+        }
+
+        geiger_toeplitz(in, out, blocks, toeplitz_accel);
+
+        bytes += geiger_pool_put(data + bytes, max - bytes, out, blocks * sizeof(u64));
+    }
+
+    smp_store_release(&buffer_tail, tail);
+
+    return bytes;
+}
+
+#ifdef KRAD_CONFIG_TUBE2
+/*
+ * Packs the low 30 bits of INNER_PULSES pulses into an INNER_BITS vector.
+ * 9 x 30 is one bit more than fits, so the last pulse gives only 29.
+ */
+static void geiger_inner_pack(const struct timespec* ring, int tail, u64* v)
+{
+    int p;
+
+    memset(v, 0, INNER_WORDS * sizeof(u64));
+
+    for(p = 0; p < INNER_PULSES; p++)
+    {
+        u64 bits = (u32) ring[(tail + p) & (BUFFER_SIZE - 1)].tv_nsec & ((1 << 30) - 1);
+        int off = p * 30;
+
+        v[off / 64] |= bits << (off % 64);
+
+        if(off % 64 > 64 - 30)
+            v[off / 64 + 1] |= bits >> (64 - off % 64);
+    }
+
+    v[INNER_WORDS - 1] &= INNER_TOP_MASK; //drops bit 29 of the last pulse
+}
+
+/*
+ * Inner product two-source extractor. Output bit i is <x, A^i y> over
+ * GF(2), where A rotates an INNER_BITS vector by one place. Each bit is the
+ * parity of the AND of the packed words, so costs a single popcount.
+ */
+static u32 geiger_inner_block(const u64* x, u64* y)
+{
+    u32 out = 0;
+    int i;
+    int w;
+
+    for(i = 0; i < INNER_OUT_BITS; i++)
+    {
+        u64 acc = 0;
+        u64 top;
+
+        for(w = 0; w < INNER_WORDS; w++)
+            acc ^= x[w] & y[w];
+
+        out |= (u32) (hweight64(acc) & 1) << i;
+
+        //rotate y left by one within INNER_BITS
+        top = (y[INNER_WORDS - 1] >> ((INNER_BITS - 1) % 64)) & 1;
+
+        for(w = INNER_WORDS - 1; w > 0; w--)
+            y[w] = (y[w] << 1) | (y[w - 1] >> 63);
+
+        y[0] = (y[0] << 1) | top;
+        y[INNER_WORDS - 1] &= INNER_TOP_MASK;
+    }
+
+    return out;
+}
+
+/*
+ * Combines pulses from both tubes, 9 from each per 4 output bytes. Call
+ * with consumer_lock held.
+ */
+static size_t geiger_inner_read(u8* data, size_t max)
+{
+    u64 x[INNER_WORDS];
+    u64 y[INNER_WORDS];
+    size_t bytes = 0;
+    int head;
+    int tail;
+    int head2;
+    int tail2;
+
+    head = buffer_ready;
+    tail = buffer_tail;
+    head2 = buffer2_ready;
+    tail2 = buffer2_tail;
+
+    while(bytes < max &&
+          CIRC_CNT(head, tail, BUFFER_SIZE) >= INNER_PULSES &&
+          CIRC_CNT(head2, tail2, BUFFER_SIZE) >= INNER_PULSES)
+    {
+        u32 out;
+
+        geiger_inner_pack(buffer, tail, x);
+        geiger_inner_pack(buffer2, tail2, y);
+        tail = (tail + INNER_PULSES) & (BUFFER_SIZE - 1);
+        tail2 = (tail2 + INNER_PULSES) & (BUFFER_SIZE - 1);
+
+        out = geiger_inner_block(x, y);
+        bytes += geiger_pool_put(data + bytes, max - bytes, &out, sizeof(out));
+    }
+
+    smp_store_release(&buffer_tail, tail);
+    smp_store_release(&buffer2_tail, tail2);
+
+    return bytes;
+}
+#endif
+
+/*
+ * Bytes the extractor could hand out right now. Call with consumer_lock held.
+ */
+static size_t geiger_extract_count(void)
+{
+    int pulses = CIRC_CNT(buffer_ready, buffer_tail, BUFFER_SIZE);
+    size_t bytes = extract_pool_len;
+
+    if(extract_mode == EXTRACT_TOEPLITZ)
+    {
+        bytes += (pulses / TOEPLITZ_PULSES) * sizeof(u64);
+    }
+#ifdef KRAD_CONFIG_TUBE2
+    else
+    {
+        int pulses2 = CIRC_CNT(buffer2_ready, buffer2_tail, BUFFER_SIZE);
+
+        bytes += (min(pulses, pulses2) / INNER_PULSES) * sizeof(u32);
+    }
+#endif
+
+    return bytes;
+}
+
+/*
+ * Runs buffered pulses through the selected extractor. Leftovers from a
+ * short read are kept for the next one. Call with consumer_lock held.
+ */
+static size_t geiger_extract_read(u8* data, size_t max)
+{
+    size_t bytes = geiger_pool_get(data, max);
+
+    if(extract_mode == EXTRACT_TOEPLITZ)
+        bytes += geiger_toeplitz_read(data + bytes, max - bytes);
+#ifdef KRAD_CONFIG_TUBE2
+    else
+        bytes += geiger_inner_read(data + bytes, max - bytes);
+#endif
+
+    return bytes;
+}
+
+/*
+ * Logs the cost of the Toeplitz extractor, in nanoseconds per output
+ * byte. get_cycles() isn't used because on arm64 it counts the generic
+ * timer, not CPU cycles.
+ */
+static void __init geiger_extract_bench(void)
+{
+    u64 in[TOEPLITZ_BATCH * TOEPLITZ_IN_WORDS];
+    u64 out[TOEPLITZ_BATCH];
+    const int rounds = 256;
+    const u64 bytes = (u64) rounds * sizeof(out);
+    int pass;
+    int r;
+
+    get_random_bytes(in, sizeof(in));
+
+    for(pass = 0; pass < 2; pass++)
+    {
+        bool accel = (pass == 1);
+        u64 ns;
+
+        if(accel && !toeplitz_accel)
+            break;
+
+        ns = ktime_to_ns(ktime_get_raw());
+
+        for(r = 0; r < rounds; r++)
+            geiger_toeplitz(in, out, TOEPLITZ_BATCH, accel);
+
+        ns = ktime_to_ns(ktime_get_raw()) - ns;
+
+        printk(KERN_INFO "krad: toeplitz (%s): %llu.%02llu ns/byte\n",
+               accel ? "clmul" : "generic",
+               div64_u64(ns, bytes), div64_u64((ns % bytes) * 100, bytes));
+    }
+}
+
+static int __init geiger_extract_init(void)
+{
+    if(sysfs_streq(extractor, "none"))
+    {
+        extract_mode = EXTRACT_NONE;
+    }
+    else if(sysfs_streq(extractor, "toeplitz"))
+    {
+        extract_mode = EXTRACT_TOEPLITZ;
+    }
+#ifdef KRAD_CONFIG_TUBE2
+    else if(sysfs_streq(extractor, "inner"))
+    {
+        extract_mode = EXTRACT_INNER;
+    }
+#endif
+    else
+    {
+        printk(KERN_ERR "krad: Unknown extractor: %s\n", extractor);
+        return -EINVAL;
+    }
+
+#ifdef KRAD_CONFIG_TUBE2
+    //the second tube is only worth wiring up for the inner product
+    if((extract_mode == EXTRACT_INNER) != (geiger_pulse_pin2 >= 0))
+    {
+        printk(KERN_ERR "krad: The inner extractor and geiger_pulse_pin2 must be used together\n");
+        return -EINVAL;
+    }
+#endif
+
+    //the seed need not be secret, only independent of the tube
+    get_random_bytes(toeplitz_seed, sizeof(toeplitz_seed));
+    toeplitz_accel = geiger_clmul_usable();
+
+    if(extractor_bench)
+        geiger_extract_bench();
+
+    return 0;
+}
+
+static inline bool geiger_extracting(void)
+{
+    return extract_mode != EXTRACT_NONE;
+}
+
+static const char* geiger_extract_name(void)
+{
+    switch(extract_mode)
+    {
+        case EXTRACT_TOEPLITZ: return toeplitz_accel ? "toeplitz with clmul" : "toeplitz";
+        case EXTRACT_INNER:    return "inner";
+        default:               return "none";
+    }
+}
+#else
+static size_t geiger_extract_count(void) { return 0; }
+static size_t geiger_extract_read(u8* data, size_t max) { return 0; }
+static int __init geiger_extract_init(void) { return 0; }
+static inline bool geiger_extracting(void) { return false; }
+static const char* geiger_extract_name(void) { return "none"; }
+#endif
+
+
+static int geiger_data_present(struct hwrng* rng, int wait)
+{
+    int head;
+    int tail;
+    int size;
+
+    spin_lock(&consumer_lock);
+    geiger_filter_run();
+    head = buffer_ready;
+    tail = buffer_tail;
+    if(geiger_extracting())
+        size = geiger_extract_count();
+    else
+        size = CIRC_CNT(head, tail, BUFFER_SIZE) * sizeof(struct timespec);
+
+    size += geiger_jitter_count() * sizeof(u32);
+    spin_unlock(&consumer_lock);
+
+    #ifdef DEBUG
+    printk(KERN_INFO "krad: geiger_data_present (%d bytes)", size);
+    #endif
+
+    return size;
+}
+
+//the old hwrng API
+static int geiger_data_read(struct hwrng* rng, u32 *data)
+{
+    int bytes = 0;
+    int head;
+    int tail;
+
+    #ifdef DEBUG
+    printk(KERN_INFO "krad: geiger_data_read called\n");
+    #endif
+
+    spin_lock(&consumer_lock);
+    geiger_filter_run();
+
+    head = buffer_ready;
+    tail = buffer_tail;
+
+    if(geiger_extracting())
+    {
+        bytes = geiger_extract_read((u8*) data, sizeof(u32));
+
+        //not enough pulses for a block yet, fall back on jitter
+        if(!bytes)
+            bytes = geiger_jitter_read((u8*) data, sizeof(u32));
+    }
+    else if(CIRC_CNT(head, tail, BUFFER_SIZE) >= 1)
+    {
+        *data = (u32) buffer[tail].tv_nsec;
+        smp_store_release(&buffer_tail, (tail + 1) & (BUFFER_SIZE - 1));
+        bytes = 4;
+    }
+    else
+    {
+        //tube is quiet, fall back on jitter
+        bytes = geiger_jitter_read((u8*) data, sizeof(u32));
+    }
+
+    geiger_ledger_deliver(bytes, true);
+
+    spin_unlock(&consumer_lock);
+    return bytes;
+}
+
+/*
+ * Copies whole raw pulses into data. Call with consumer_lock held.
+ */
+static size_t geiger_pulse_read(u8* data, size_t max)
+{
+    int head;
+    int tail;
+    size_t p;
+    size_t pulses_given;
+
+    head = buffer_ready;
+    tail = buffer_tail;
+
+    //figure out how much we can give them
+    pulses_given = min((size_t) max / sizeof(struct timespec),      //pulses wanted
+                       (size_t) CIRC_CNT(head, tail, BUFFER_SIZE)); //pulses we have
+
+    if(!pulses_given && max < sizeof(struct timespec))
+    {
+        printk(KERN_INFO "krad: %s was called with max bytes (%zu) smaller than the storage type\n", __func__, max);
+    }
+
+    for(p = 0; p < pulses_given; p++)
+    {
+        #ifdef DEBUG
+        printk(KERN_INFO "krad: dispensed pulse: %ld seconds %ld nanoseconds \n", buffer[tail].tv_sec, buffer[tail].tv_nsec);
+        #endif
+
+        ((struct timespec*) data)[p] = buffer[tail];
+        tail = (tail + 1) & (BUFFER_SIZE - 1);
+    }
+
+    smp_store_release(&buffer_tail, tail);
+
+    return pulses_given * sizeof(struct timespec);
+}
+
+//the new hwrng API
+static int geiger_read(struct hwrng* rng, void* data, size_t max, bool wait)
+{
+    size_t bytes;
+
+    #ifdef DEBUG
+    printk(KERN_INFO "krad: geiger_read called\n");
+    #endif
+
+    spin_lock(&consumer_lock);
+    geiger_filter_run();
+
+    if(geiger_extracting())
+        bytes = geiger_extract_read((u8*) data, max);
+    else
+        bytes = geiger_pulse_read((u8*) data, max);
+
+    //top up with jitter after the tube data
+    bytes += geiger_jitter_read((u8*) data + bytes, max - bytes);
+
+    geiger_ledger_deliver(bytes, false);
+
+    spin_unlock(&consumer_lock);
+
+    return bytes;
+}
+
+
+static struct hwrng geiger_rng = {
+    "krad",
+    NULL,
+    NULL,
+    geiger_data_present,
+    geiger_data_read,
+    geiger_read,
+    0,
+    32
+};
+
+
+/*
+ * Suspend and resume. The pulse and jitter buffers survive suspend and stay
+ * readable straight after wake; only state tied to the passage of time is
+ * thrown away.
+ */
+static bool geiger_irq_disabled = false;
+
+static int geiger_pm_notify(struct notifier_block* nb, unsigned long action, void* data)
+{
+    unsigned long flags;
+
+    switch(action)
+    {
+        case PM_SUSPEND_PREPARE:
+        case PM_HIBERNATION_PREPARE:
+            //the pulse line may glitch while the GPIO controller is powered down
+            if(geiger_irq >= 0)
+                disable_irq(geiger_irq);
+            if(geiger_irq2 >= 0)
+                disable_irq(geiger_irq2);
+            geiger_irq_disabled = true;
+            geiger_jitter_suspend();
+
+            //filter what arrived before suspend against the old baselines
+            spin_lock(&consumer_lock);
+            geiger_filter_run();
+            spin_unlock(&consumer_lock);
+            break;
+
+        case PM_POST_SUSPEND:
+        case PM_POST_HIBERNATION:
+            if(!geiger_irq_disabled)
+                break;
+
+            //the first interval after wake would span the whole suspend
+            spin_lock_irqsave(&producer_lock, flags);
+            geiger_ledger_restart();
+            spin_unlock_irqrestore(&producer_lock, flags);
+
+            spin_lock(&consumer_lock);
+            geiger_filter_restart();
+            spin_unlock(&consumer_lock);
+
+            geiger_jitter_resume();
+
+            geiger_irq_disabled = false;
+            if(geiger_irq >= 0)
+                enable_irq(geiger_irq);
+            if(geiger_irq2 >= 0)
+                enable_irq(geiger_irq2);
+            break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block geiger_pm_nb = {
+    .notifier_call = geiger_pm_notify,
+};
+
+/*
+ * Reads the clock selected by the clock_id parameter
+ */
+static void geiger_timestamp(struct timespec* t)
+{
+    switch(clock_id)
+    {
+        case CLOCK_TAI:
+            *t = ktime_to_timespec(ktime_get_clocktai());
+            break;
+        case CLOCK_MONOTONIC_RAW:
+            getrawmonotonic(t);
+            break;
+        default:
+            getnstimeofday(t);
+            break;
+    }
+}
+
+static const char* geiger_clock_name(void)
+{
+    switch(clock_id)
+    {
+        case CLOCK_TAI:           return "TAI";
+        case CLOCK_MONOTONIC_RAW: return "MONOTONIC_RAW";
+        default:                  return "REALTIME";
+    }
+}
+
+#ifdef KRAD_CONFIG_CHARDEV
+/*
+ * The ring userspace maps from /dev/krad (see krad_ring_info). It is
+ * separate from the hwrng buffer, which the filter compacts in place.
+ */
+#define TAP_SIZE (PAGE_SIZE / sizeof(struct krad_pulse))
+static struct krad_ring_info* tap_info;
+static struct krad_pulse* tap_ring;
+static DECLARE_WAIT_QUEUE_HEAD(tap_wait);
 
-DEFINE_SPINLOCK(producer_lock); //lock for the ISR, not that it should need one...
-DEFINE_SPINLOCK(consumer_lock); //lock for hwrng API
+//call with producer_lock held
+static void geiger_tap(const struct timespec* t)
+{
+    struct krad_pulse* r;
+    u32 seq;
 
+    if(!tap_info)
+        return;
 
+    seq = tap_info->seq;
+    r = &tap_ring[seq & (TAP_SIZE - 1)];
+    smp_wmb(); //seq must reach n before pulse n - TAP_SIZE is overwritten
+    r->tv_sec = t->tv_sec;
+    r->tv_nsec = t->tv_nsec;
+    smp_store_release(&tap_info->seq, seq + 1);
+    wake_up_interruptible(&tap_wait);
+}
+#else
+static void geiger_tap(const struct timespec* t) { }
+#endif
 
-static int geiger_data_present(struct hwrng* rng, int wait)
+/*
+ * Queues a pulse from either tube. Call with producer_lock held.
+ */
+static void geiger_push(int tube, const struct timespec* t)
 {
+    struct timespec* ring = buffer;
+    int* ring_head = &buffer_head;
+    int* ring_tail = &buffer_tail;
     int head;
     int tail;
-    int size;
 
-    spin_lock(&consumer_lock);
-    head = smp_load_acquire(&buffer_head);
-    tail = buffer_tail;
-    spin_unlock(&consumer_lock);
+#ifdef KRAD_CONFIG_TUBE2
+    if(tube)
+    {
+        ring = buffer2;
+        ring_head = &buffer2_head;
+        ring_tail = &buffer2_tail;
+    }
+#endif
 
-    size = CIRC_CNT(head, tail, BUFFER_SIZE) * sizeof(struct timespec);
+    ledger_add(samples_in, 1);
+    ledger_add(estimated_bits, geiger_estimate_entropy(&intervals[tube], t));
 
-    #ifdef DEBUG
-    printk(KERN_INFO "krad: geiger_data_present (%d bytes)", size);
-    #endif
+    if(!tube)
+        geiger_tap(t);
 
-    return size;
+    head = *ring_head;
+    tail = ACCESS_ONCE(*ring_tail);
+
+    if(CIRC_SPACE(head, tail, BUFFER_SIZE) >= 1)
+    {
+        ring[head] = *t;
+        smp_store_release(ring_head, (head + 1) & (BUFFER_SIZE - 1));
+    }
+    else
+    {
+        ledger_add(samples_dropped, 1);
+    }
 }
 
-//the old hwrng API
-static int geiger_data_read(struct hwrng* rng, u32 *data)
+/*
+ * The interrupt service routine called on geiger pulses
+ */
+static irqreturn_t geiger_isr(int irq, void *data)
 {
-    int bytes = 0;
-    int head;
-    int tail;
+    if(irq == geiger_irq || irq == geiger_irq2)
+    {
+        struct timespec t;
 
-    #ifdef DEBUG
-    printk(KERN_INFO "krad: geiger_data_read called\n");
-    #endif
+        geiger_timestamp(&t);
 
-    spin_lock(&consumer_lock);
+        #ifdef DEBUG
+        printk(KERN_INFO "krad: acquired pulse: %ld seconds %ld nanoseconds \n", t.tv_sec, t.tv_nsec);
+        #endif
 
-    head = smp_load_acquire(&buffer_head);
-    tail = buffer_tail;
+        spin_lock(&producer_lock);
+        geiger_push(irq == geiger_irq2, &t);
+        spin_unlock(&producer_lock);
+    }
+
+    return IRQ_HANDLED;
+}
+
+/*
+ * Claims a pulse GPIO and hooks the ISR up to it
+ */
+static int geiger_gpio_init(int pin, int* irq, const char* label, const char* irq_name)
+{
+    int ret;
 
-    if(CIRC_CNT(head, tail, BUFFER_SIZE) >= 1)
+    ret = gpio_request_one(pin, GPIOF_IN, label);
+
+    if(ret)
     {
-        *data = (u32) buffer[tail].tv_nsec;
-        smp_store_release(&buffer_tail, (tail + 1) & (BUFFER_SIZE - 1));
-        bytes = 4;
+        printk(KERN_ERR "krad: Unable to request GPIO %d for the Geiger Counter: %d\n", pin, ret);
+        return ret;
     }
 
-    spin_unlock(&consumer_lock);
-    return bytes;
+    ret = gpio_to_irq(pin);
+
+    if(ret < 0)
+    {
+        printk(KERN_ERR "krad: Unable to request IRQ: %d\n", ret);
+        goto fail;
+    }
+
+    *irq = ret;
+
+    ret = request_irq(*irq, geiger_isr, IRQF_TRIGGER_RISING, irq_name, NULL);
+
+    if(ret)
+    {
+        printk(KERN_ERR "krad: Unable to request IRQ: %d\n", ret);
+        *irq = -1;
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    gpio_free(pin);
+    return ret;
 }
 
-//the new hwrng API
-static int geiger_read(struct hwrng* rng, void* data, size_t max, bool wait)
+static void geiger_gpio_exit(int pin, int irq)
 {
-    int head;
-    int tail;
-    size_t p;
-    size_t pulses_given;
+    if(pin < 0)
+        return;
 
-    #ifdef DEBUG
-    printk(KERN_INFO "krad: geiger_read called\n");
-    #endif
+    free_irq(irq, NULL);
+    gpio_free(pin);
+}
 
-    spin_lock(&consumer_lock);
+#ifdef KRAD_CONFIG_CHARDEV
+/*
+ * /dev/krad, for controlling krad from userspace
+ */
+static long geiger_dev_ioctl(struct file* file, unsigned int cmd, unsigned long arg)
+{
+    switch(cmd)
+    {
+        case KRAD_SET_FILTER:
+        {
+            struct sock_fprog fprog;
 
-    head = smp_load_acquire(&buffer_head);
-    tail = buffer_tail;
+            if(copy_from_user(&fprog, (const void __user*) arg, sizeof(fprog)))
+                return -EFAULT;
 
-    //figure out how much we can give them
-    pulses_given = min((size_t) max / sizeof(struct timespec),      //pulses wanted
-                       (size_t) CIRC_CNT(head, tail, BUFFER_SIZE)); //pulses we have
+            return geiger_filter_attach(&fprog);
+        }
+        case KRAD_CLEAR_FILTER:
+            return geiger_filter_attach(NULL);
+        case KRAD_SET_CURSOR:
+        {
+            u32 cursor;
+
+            if(get_user(cursor, (u32 __user*) arg))
+                return -EFAULT;
 
-    if(!pulses_given)
+            file->private_data = (void*)(unsigned long) cursor;
+            return 0;
+        }
+        default:
+            return -ENOTTY;
+    }
+}
+
+#ifdef CONFIG_COMPAT
+//KRAD_SET_FILTER as issued by 32 bit processes, whose sock_fprog is smaller
+#define KRAD_SET_FILTER32 _IOW(KRAD_IOC_MAGIC, 1, struct compat_sock_fprog)
+
+/*
+ * 32 bit processes on a 64 bit kernel. Only the filter program needs
+ * translating, as it does for seccomp.
+ */
+static long geiger_dev_compat_ioctl(struct file* file, unsigned int cmd, unsigned long arg)
+{
+    if(cmd == KRAD_SET_FILTER32)
     {
-        printk(KERN_INFO "krad: %s was called with max bytes (%zu) smaller than the storage type\n", __func__, max);
+        struct compat_sock_fprog fprog32;
+        struct sock_fprog fprog;
+
+        if(copy_from_user(&fprog32, compat_ptr(arg), sizeof(fprog32)))
+            return -EFAULT;
+
+        fprog.len = fprog32.len;
+        fprog.filter = compat_ptr(fprog32.filter);
+
+        return geiger_filter_attach(&fprog);
     }
 
-    for(p = 0; p < pulses_given; p++)
+    return geiger_dev_ioctl(file, cmd, (unsigned long) compat_ptr(arg));
+}
+#endif
+
+/*
+ * Takes pulses from userspace sources such as kradaudio. They share the
+ * first tube's buffer, ledger and filter with pulses from the GPIO.
+ */
+static ssize_t geiger_dev_write(struct file* file, const char __user* buf, size_t count, loff_t* ppos)
+{
+    struct krad_pulse pulses[16];
+    size_t done = 0;
+
+    if(count % sizeof(struct krad_pulse))
+        return -EINVAL;
+
+    while(done < count)
     {
-        #ifdef DEBUG
-        printk(KERN_INFO "krad: dispensed pulse: %ld seconds %ld nanoseconds \n", buffer[tail].tv_sec, buffer[tail].tv_nsec);
-        #endif
+        size_t n = min(count - done, sizeof(pulses)) / sizeof(struct krad_pulse);
+        unsigned long flags;
+        size_t p;
 
-        ((struct timespec*) data)[p] = buffer[tail];
-        smp_store_release(&buffer_tail, (tail + 1) & (BUFFER_SIZE - 1));
+        if(copy_from_user(pulses, buf + done, n * sizeof(struct krad_pulse)))
+            return done ? done : -EFAULT;
+
+        for(p = 0; p < n; p++)
+        {
+            if(pulses[p].tv_nsec < 0 || pulses[p].tv_nsec >= NSEC_PER_SEC)
+                return done ? done : -EINVAL;
+        }
+
+        spin_lock_irqsave(&producer_lock, flags);
+
+        for(p = 0; p < n; p++)
+        {
+            struct timespec t;
+
+            t.tv_sec = pulses[p].tv_sec;
+            t.tv_nsec = pulses[p].tv_nsec;
+            geiger_push(0, &t);
+        }
+
+        spin_unlock_irqrestore(&producer_lock, flags);
+
+        done += n * sizeof(struct krad_pulse);
     }
 
-    spin_unlock(&consumer_lock);
+    return done;
+}
 
-    return pulses_given * sizeof(struct timespec);
+/*
+ * Each open file keeps a cursor in private_data, which poll() compares
+ * against the ring's seq. It starts at the current seq.
+ */
+static int geiger_dev_open(struct inode* inode, struct file* file)
+{
+    file->private_data = (void*)(unsigned long) smp_load_acquire(&tap_info->seq);
+    return nonseekable_open(inode, file);
 }
 
+static unsigned int geiger_dev_poll(struct file* file, poll_table* wait)
+{
+    u32 cursor = (unsigned long) file->private_data;
 
-static struct hwrng geiger_rng = {
-    "krad",
-    NULL,
-    NULL,
-    geiger_data_present,
-    geiger_data_read,
-    geiger_read,
-    0,
-    32
-};
+    poll_wait(file, &tap_wait, wait);
 
+    if(smp_load_acquire(&tap_info->seq) != cursor)
+        return POLLIN | POLLRDNORM;
+
+    return 0;
+}
 
 /*
- * The interrupt service routine called on geiger pulses
+ * Maps the info page, then the ring, read-only
  */
-static irqreturn_t geiger_isr(int irq, void *data)
+static int geiger_dev_mmap(struct file* file, struct vm_area_struct* vma)
+{
+    unsigned long size = vma->vm_end - vma->vm_start;
+    int ret;
+
+    if(vma->vm_pgoff || size > 2 * PAGE_SIZE)
+        return -EINVAL;
+
+    if(vma->vm_flags & VM_WRITE)
+        return -EPERM;
+
+    vma->vm_flags &= ~VM_MAYWRITE;
+
+    ret = remap_pfn_range(vma, vma->vm_start, virt_to_phys(tap_info) >> PAGE_SHIFT,
+                          PAGE_SIZE, vma->vm_page_prot);
+
+    if(!ret && size > PAGE_SIZE)
+        ret = remap_pfn_range(vma, vma->vm_start + PAGE_SIZE, virt_to_phys(tap_ring) >> PAGE_SHIFT,
+                              PAGE_SIZE, vma->vm_page_prot);
+
+    return ret;
+}
+
+static const struct file_operations geiger_fops = {
+    .owner          = THIS_MODULE,
+    .open           = geiger_dev_open,
+    .poll           = geiger_dev_poll,
+    .mmap           = geiger_dev_mmap,
+    .unlocked_ioctl = geiger_dev_ioctl,
+#ifdef CONFIG_COMPAT
+    .compat_ioctl   = geiger_dev_compat_ioctl,
+#endif
+    .write          = geiger_dev_write,
+    .llseek         = no_llseek,
+};
+
+/*
+ * Root only, like /dev/hwrng. The ring holds the same timestamps the hwrng
+ * core credits to the kernel's pool, so whoever can map it can see
+ * credited entropy input.
+ */
+static struct miscdevice geiger_dev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name  = "krad",
+    .fops  = &geiger_fops,
+    .mode  = 0600,
+};
+
+static int geiger_dev_init(void)
 {
-    if(irq == geiger_irq)
+    struct krad_ring_info* info;
+    unsigned long flags;
+    int ret;
+
+    info = (struct krad_ring_info*) get_zeroed_page(GFP_KERNEL);
+    tap_ring = (struct krad_pulse*) get_zeroed_page(GFP_KERNEL);
+
+    if(!info || !tap_ring)
     {
-        struct timespec t = CURRENT_TIME;
-        int head;
-        int tail;
+        printk(KERN_ERR "krad: Not enough memory for the /dev/krad ring\n");
+        ret = -ENOMEM;
+        goto fail;
+    }
 
-        #ifdef DEBUG
-        printk(KERN_INFO "krad: acquired pulse: %ld seconds %ld nanoseconds \n", t.tv_sec, t.tv_nsec);
-        #endif
+    info->magic = KRAD_RING_MAGIC;
+    info->size = TAP_SIZE;
+    info->record_size = sizeof(struct krad_pulse);
+    info->ring_offset = PAGE_SIZE;
+    info->clock_id = clock_id;
 
-        spin_lock(&producer_lock);
+    //the ISR may already be running
+    spin_lock_irqsave(&producer_lock, flags);
+    tap_info = info;
+    spin_unlock_irqrestore(&producer_lock, flags);
 
-        head = buffer_head;
-        tail = ACCESS_ONCE(buffer_tail);
+    ret = misc_register(&geiger_dev);
 
-        if(CIRC_SPACE(head, tail, BUFFER_SIZE) >= 1)
-        {
-            buffer[head] = t;
-            smp_store_release(&buffer_head, (head + 1) & (BUFFER_SIZE - 1));
-        }
+    if(!ret)
+        return 0;
 
-        spin_unlock(&producer_lock);
+    printk(KERN_ERR "krad: Unable to register /dev/krad: %d\n", ret);
+
+    spin_lock_irqsave(&producer_lock, flags);
+    tap_info = NULL;
+    spin_unlock_irqrestore(&producer_lock, flags);
+
+fail:
+    free_page((unsigned long) info);
+    free_page((unsigned long) tap_ring);
+    tap_ring = NULL;
+    return ret;
+}
+
+static void geiger_dev_exit(void)
+{
+    struct krad_ring_info* info;
+    unsigned long flags;
+
+    misc_deregister(&geiger_dev);
+
+    spin_lock_irqsave(&producer_lock, flags);
+    info = tap_info;
+    tap_info = NULL;
+    spin_unlock_irqrestore(&producer_lock, flags);
+
+    free_page((unsigned long) info);
+    free_page((unsigned long) tap_ring);
+    tap_ring = NULL;
+}
+#else
+static int geiger_dev_init(void) { return 0; }
+static void geiger_dev_exit(void) { }
+#endif
+
+#ifdef KRAD_CONFIG_TUBE2
+/*
+ * Sets up the second tube, if there is one
+ */
+static int geiger_tube2_init(void)
+{
+    int ret;
+
+    if(geiger_pulse_pin2 < 0)
+        return 0;
+
+    buffer2 = kcalloc(BUFFER_SIZE, sizeof(struct timespec), GFP_KERNEL);
+
+    if(!buffer2)
+    {
+        printk(KERN_ERR "krad: Not enough memory for second buffer\n");
+        return -ENOMEM;
     }
 
-    return IRQ_HANDLED;
+    ret = geiger_gpio_init(geiger_pulse_pin2, &geiger_irq2, "Geiger Pulse 2", "krad#geiger2");
+
+    if(ret)
+    {
+        kfree(buffer2);
+        buffer2 = NULL;
+    }
+
+    return ret;
+}
+
+static void geiger_tube2_exit(void)
+{
+    if(geiger_pulse_pin2 < 0)
+        return;
+
+    geiger_gpio_exit(geiger_pulse_pin2, geiger_irq2);
+    kfree(buffer2);
 }
+#else
+static int geiger_tube2_init(void) { return 0; }
+static void geiger_tube2_exit(void) { }
+#endif
 
 /*
  * Module init function
@@ -185,62 +2180,108 @@ static int __init krad_init(void)
 {
     int ret = 0;
 
+    if(clock_id != CLOCK_REALTIME &&
+       clock_id != CLOCK_TAI &&
+       clock_id != CLOCK_MONOTONIC_RAW)
+    {
+        printk(KERN_ERR "krad: Unsupported clock_id: %d\n", clock_id);
+        return -EINVAL;
+    }
+
+    #ifndef KRAD_CONFIG_CHARDEV
+    if(geiger_pulse_pin < 0)
+    {
+        printk(KERN_ERR "krad: geiger_pulse_pin is required when /dev/krad is compiled out\n");
+        return -EINVAL;
+    }
+    #endif
+
+    ret = geiger_extract_init();
+
+    if(ret)
+        return ret;
+
+    #ifndef KRAD_TINY
     //allocate a single page for our circular buffer
     buffer = (struct timespec*) __get_free_page(GFP_KERNEL);
 
     if(!buffer)
     {
         printk(KERN_ERR "krad: Not enough memory for buffer\n");
-        return ENOMEM;
+        return -ENOMEM;
     }
+    #endif
 
-    // register Geiger pulse gpio
-    ret = gpio_request_one(geiger_pulse_pin, GPIOF_IN, "Geiger Pulse");
-
-    if(ret)
+    // register Geiger pulse gpio, unless pulses come from userspace
+    if(geiger_pulse_pin >= 0)
     {
-        printk(KERN_ERR "krad: Unable to request GPIO for the Geiger Counter: %d\n", ret);
-        goto fail1;
+        ret = geiger_gpio_init(geiger_pulse_pin, &geiger_irq, "Geiger Pulse", "krad#geiger");
+
+        if(ret)
+            goto fail1;
     }
 
-    ret = gpio_to_irq(geiger_pulse_pin);
+    ret = geiger_tube2_init();
 
-    if(ret < 0)
-    {
-        printk(KERN_ERR "krad: Unable to request IRQ: %d\n", ret);
+    if(ret)
         goto fail2;
-    }
 
-    geiger_irq = ret;
+    ret = geiger_jitter_start();
+
+    if(ret)
+        goto fail3;
 
-    ret = request_irq(geiger_irq, geiger_isr, IRQF_TRIGGER_RISING, "krad#geiger", NULL);
+    ret = register_pm_notifier(&geiger_pm_nb);
 
     if(ret)
     {
-        printk(KERN_ERR "krad: Unable to request IRQ: %d\n", ret);
-        goto fail2;
+        printk(KERN_ERR "krad: Unable to register PM notifier: %d\n", ret);
+        goto fail4;
     }
 
+    ret = geiger_ledger_init();
+
+    if(ret)
+        goto fail5;
+
+    ret = geiger_dev_init();
+
+    if(ret)
+        goto fail6;
+
     ret = hwrng_register(&geiger_rng);
 
     if(ret)
     {
         printk(KERN_ERR "krad: Unable to register hardware RNG device: %d\n", ret);
-        goto fail3;
+        goto fail7;
     }
 
-    printk(KERN_INFO "krad: started (buffer size %lu pulses)\n", BUFFER_SIZE);
+    printk(KERN_INFO "krad: started (buffer size %lu pulses, clock %s, extractor %s)\n",
+           BUFFER_SIZE, geiger_clock_name(), geiger_extract_name());
 
     // finished successfully
     return 0;
 
 
     // failure cases
+fail7:
+    geiger_dev_exit();
+    geiger_filter_exit();
+fail6:
+    geiger_ledger_exit();
+fail5:
+    unregister_pm_notifier(&geiger_pm_nb);
+fail4:
+    geiger_jitter_stop();
 fail3:
-    free_irq(geiger_irq, NULL);
+    geiger_tube2_exit();
 fail2:
-    gpio_free(geiger_pulse_pin);
+    geiger_gpio_exit(geiger_pulse_pin, geiger_irq);
 fail1:
+    #ifndef KRAD_TINY
+    free_page((unsigned long) buffer);
+    #endif
     return ret;
 }
 
@@ -252,14 +2293,29 @@ static void __exit krad_exit(void)
     // unregister the hwrng
     hwrng_unregister(&geiger_rng);
 
-    // free irqs
-    free_irq(geiger_irq, NULL);
+    // remove /dev/krad and any filter loaded through it
+    geiger_dev_exit();
+    geiger_filter_exit();
+
+    // remove the ledger from sysfs
+    geiger_ledger_exit();
 
-    // unregister
-    gpio_free(geiger_pulse_pin);
+    // stop following suspend/resume
+    unregister_pm_notifier(&geiger_pm_nb);
 
+    // stop the jitter source
+    geiger_jitter_stop();
+
+    // release the second tube
+    geiger_tube2_exit();
+
+    // free irqs and unregister
+    geiger_gpio_exit(geiger_pulse_pin, geiger_irq);
+
+    #ifndef KRAD_TINY
     //release our buffer memory
     free_page((unsigned long) buffer);
+    #endif
 
     printk(KERN_INFO "krad: stopped\n");
 }
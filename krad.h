@@ -0,0 +1,87 @@
+/*
+ * Userspace interface to the kRad geiger counter RNG (/dev/krad)
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ */
+
+#ifndef _KRAD_H
+#define _KRAD_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+#include <linux/filter.h>
+
+/*
+ * What a pulse filter sees for each pulse. Filters are classic BPF
+ * programs that read these fields with 32 bit absolute loads
+ * (BPF_LD | BPF_W | BPF_ABS), the same way seccomp filters read
+ * seccomp_data.
+ *
+ * A filter returns 0 to drop the pulse, and anything else to keep it
+ * unchanged. Pulses are credited as they were captured, so filters can't
+ * rewrite them. A return value below KRAD_FILTER_TAGS also tags the
+ * pulse: tag n is counted in /sys/module/krad/ledger/filter_tags.
+ */
+#define KRAD_FILTER_DROP 0
+#define KRAD_FILTER_KEEP 0xffffffff //keep, untagged
+#define KRAD_FILTER_TAGS 16
+
+struct krad_pulse_data
+{
+    __u32 tv_sec;      //low 32 bits of the seconds
+    __u32 tv_nsec;
+    __u32 interval_ns; //since the previous pulse from the same tube, saturated, 0 if unknown
+    __u32 tube;        //0, or 1 for geiger_pulse_pin2
+};
+
+/*
+ * A pulse, as written to /dev/krad by userspace pulse sources. Timestamps
+ * must come from the clock krad was loaded with (see
+ * /sys/module/krad/parameters/clock_id).
+ */
+struct krad_pulse
+{
+    __s64 tv_sec;
+    __s64 tv_nsec;
+};
+
+/*
+ * /dev/krad can be mapped read-only. The first page holds a
+ * krad_ring_info, and ring_offset bytes into the mapping is a ring of
+ * the first tube's pulses as struct krad_pulse, which is laid out the
+ * same for 32 and 64 bit kernels and processes. Every pulse goes into
+ * the ring before filtering, and the ring overwrites its oldest pulse
+ * when full, so readers never hold back the hwrng side.
+ *
+ * Pulse n is stored at index n & (size - 1). seq counts the pulses
+ * written so far and wraps at 2^32. The kernel moves seq to n before it
+ * starts writing pulse n, and to n + 1 once it is complete, so pulse n
+ * was read intact if seq, read again afterwards, is less than n + size.
+ * libkrad wraps all of this up.
+ *
+ * These are the same timestamps the hwrng core reads, and with
+ * extractor=none, credits to the kernel's pool. Anyone who can map the
+ * ring sees that input, so /dev/krad is root only. Opening it to a group
+ * trusts that group as much as root.
+ */
+#define KRAD_RING_MAGIC 0x6b726164 //"krad"
+
+struct krad_ring_info
+{
+    __u32 magic;       //KRAD_RING_MAGIC
+    __u32 size;        //pulses in the ring, a power of two
+    __u32 record_size; //sizeof(struct krad_pulse)
+    __u32 ring_offset; //where the ring starts in the mapping
+    __u32 clock_id;    //clock the pulses were timestamped with
+    __u32 seq;
+};
+
+#define KRAD_IOC_MAGIC    'k'
+#define KRAD_SET_FILTER   _IOW(KRAD_IOC_MAGIC, 1, struct sock_fprog) //needs CAP_SYS_ADMIN
+#define KRAD_CLEAR_FILTER _IO(KRAD_IOC_MAGIC, 2)
+#define KRAD_SET_CURSOR   _IOW(KRAD_IOC_MAGIC, 3, __u32) //poll() waits for seq to move past this
+
+#endif
@@ -0,0 +1,259 @@
+/*
+ * Throughput benchmark for libkrad
+ *
+ * By default a writer thread fills a fake ring in memory the same way
+ * the kernel fills /dev/krad's, and the reader pulls from it with
+ * libkrad. The writer stays at most half a ring ahead of the reader, so
+ * this measures what the library can sustain (real tubes come nowhere
+ * near) and nothing should be lost. -d reads a real device instead.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "libkrad.h"
+
+#define RING_SIZE 256  //what the kernel uses with 4K pages
+#define MAX_BATCH 4096
+
+struct fake
+{
+    void* map;
+    struct krad_ring_info* info;
+    struct krad_pulse* ring;
+    uint32_t consumed; //published by the reader
+    volatile bool stop;
+};
+
+static double now(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+//the kernel's geiger_tap(), with a counter for a clock
+static void* writer(void* arg)
+{
+    struct fake* f = arg;
+    uint32_t seq = 0;
+
+    while(!f->stop)
+    {
+        if(seq - __atomic_load_n(&f->consumed, __ATOMIC_RELAXED) > RING_SIZE / 2)
+        {
+            sched_yield(); //in case the reader shares this CPU
+            continue;
+        }
+
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        f->ring[seq & (RING_SIZE - 1)].tv_sec = seq;
+        f->ring[seq & (RING_SIZE - 1)].tv_nsec = seq % 1000000000;
+        __atomic_store_n(&f->info->seq, seq + 1, __ATOMIC_RELEASE);
+        seq++;
+    }
+
+    return NULL;
+}
+
+static int fake_init(struct fake* f, size_t* len)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    *len = page + RING_SIZE * sizeof(struct krad_pulse);
+    f->map = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(f->map == MAP_FAILED)
+        return -1;
+
+    f->info = f->map;
+    f->ring = (struct krad_pulse*) ((char*) f->map + page);
+    f->info->magic = KRAD_RING_MAGIC;
+    f->info->size = RING_SIZE;
+    f->info->record_size = sizeof(struct krad_pulse);
+    f->info->ring_offset = page;
+    f->info->clock_id = CLOCK_MONOTONIC_RAW;
+    f->consumed = 0;
+    f->stop = false;
+    return 0;
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr,
+        "usage: %s [-d device] [-b batch] [-t seconds] [-z]\n"
+        "  -d  read a real device instead of the in-memory ring\n"
+        "  -b  pulses per pull (default 64, max %d)\n"
+        "  -t  how long to run (default 5)\n"
+        "  -z  use zero-copy views instead of copying pulls\n",
+        name, MAX_BATCH);
+}
+
+int main(int argc, char** argv)
+{
+    static struct krad_pulse out[MAX_BATCH];
+    const char* device = NULL;
+    size_t batch = 64;
+    double seconds = 5;
+    bool zero_copy = false;
+    struct fake f;
+    pthread_t thread;
+    struct krad* k;
+    uint64_t pulses = 0;
+    uint64_t pulls = 0;
+    uint64_t sum = 0;
+    uint64_t disorder = 0;
+    uint32_t expect = 0;
+    double start;
+    double elapsed;
+    size_t len;
+    int opt;
+
+    while((opt = getopt(argc, argv, "d:b:t:zh")) != -1)
+    {
+        switch(opt)
+        {
+            case 'd': device = optarg; break;
+            case 'b': batch = strtoul(optarg, NULL, 0); break;
+            case 't': seconds = atof(optarg); break;
+            case 'z': zero_copy = true; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if(!batch || batch > MAX_BATCH || seconds <= 0)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if(device)
+    {
+        k = krad_open(device);
+
+        if(!k)
+        {
+            fprintf(stderr, "krad_bench: %s: %s\n", device, strerror(errno));
+            return 1;
+        }
+    }
+    else
+    {
+        if(fake_init(&f, &len))
+        {
+            perror("krad_bench: mmap");
+            return 1;
+        }
+
+        k = krad_attach(f.map, len, -1);
+
+        if(!k || pthread_create(&thread, NULL, writer, &f))
+        {
+            fprintf(stderr, "krad_bench: unable to set up the fake ring\n");
+            return 1;
+        }
+    }
+
+    start = now();
+
+    do
+    {
+        size_t n;
+
+        if(device && krad_wait(k, 100) < 0)
+        {
+            perror("krad_bench: poll");
+            break;
+        }
+
+        if(zero_copy)
+        {
+            struct krad_view view;
+            size_t i;
+            size_t bad;
+
+            n = krad_peek(k, &view, batch);
+
+            //touch every pulse, as a consumer would
+            for(i = 0; i < view.first_len; i++)
+                sum += view.first[i].tv_nsec;
+
+            for(i = 0; i < view.second_len; i++)
+                sum += view.second[i].tv_nsec;
+
+            if(n && !device)
+                disorder += (uint32_t) view.first[0].tv_sec != view.seq;
+
+            bad = krad_release(k, &view);
+            n -= bad;
+        }
+        else
+        {
+            size_t i;
+
+            n = krad_read(k, out, batch);
+
+            for(i = 0; i < n; i++)
+            {
+                sum += out[i].tv_nsec;
+
+                //the fake writer numbers its pulses
+                if(!device && !krad_lost(k))
+                    disorder += (uint32_t) out[i].tv_sec != expect++;
+            }
+        }
+
+        if(!device)
+        {
+            __atomic_store_n(&f.consumed, (uint32_t) (pulses + n + krad_lost(k)), __ATOMIC_RELAXED);
+
+            if(!n)
+                sched_yield();
+        }
+
+        pulses += n;
+        pulls++;
+    }
+    while(now() - start < seconds);
+
+    elapsed = now() - start;
+
+    if(!device)
+    {
+        f.stop = true;
+        pthread_join(thread, NULL);
+    }
+
+    printf("%s, batch %zu: %.0f pulses/s, %.0f pulls/s, %llu lost (checksum %llx)\n",
+           zero_copy ? "zero-copy" : "copy", batch,
+           pulses / elapsed, pulls / elapsed,
+           (unsigned long long) krad_lost(k), (unsigned long long) sum);
+
+    if(disorder)
+        printf("%llu pulses out of order\n", (unsigned long long) disorder);
+
+    krad_close(k);
+    return disorder ? 1 : 0;
+}
@@ -0,0 +1,261 @@
+/*
+ * libkrad, batched and zero-copy access to the pulses krad publishes on
+ * /dev/krad
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "libkrad.h"
+
+struct krad
+{
+    int fd;
+    void* map;     //only set when the handle did the mapping
+    size_t map_len;
+    const struct krad_ring_info* info;
+    const struct krad_pulse* ring;
+    uint32_t size;
+    uint32_t cursor; //next pulse to read
+    uint64_t lost;
+};
+
+//pairs with the smp_store_release() in the kernel's geiger_tap()
+static uint32_t ring_seq(const struct krad* k)
+{
+    return __atomic_load_n(&k->info->seq, __ATOMIC_ACQUIRE);
+}
+
+struct krad* krad_attach(const void* map, size_t len, int fd)
+{
+    const struct krad_ring_info* info = map;
+    struct krad* k;
+
+    if(len < sizeof(*info) ||
+       info->magic != KRAD_RING_MAGIC ||
+       info->record_size != sizeof(struct krad_pulse) ||
+       info->size < 2 || (info->size & (info->size - 1)) ||
+       info->ring_offset % sizeof(struct krad_pulse) ||
+       len < info->ring_offset ||
+       (len - info->ring_offset) / sizeof(struct krad_pulse) < info->size)
+    {
+        errno = EPROTO;
+        return NULL;
+    }
+
+    k = calloc(1, sizeof(*k));
+
+    if(!k)
+        return NULL;
+
+    k->fd = fd;
+    k->info = info;
+    k->ring = (const struct krad_pulse*) ((const char*) map + info->ring_offset);
+    k->size = info->size;
+    k->cursor = ring_seq(k);
+    return k;
+}
+
+struct krad* krad_open(const char* path)
+{
+    const struct krad_ring_info* info;
+    struct krad* k;
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len;
+    void* map;
+    int fd;
+    int err;
+
+    fd = open(path ? path : "/dev/krad", O_RDONLY | O_CLOEXEC);
+
+    if(fd < 0)
+        return NULL;
+
+    //the info page says how much there is to map
+    info = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, 0);
+
+    if(info == MAP_FAILED)
+        goto fail;
+
+    len = info->ring_offset + (size_t) info->size * info->record_size;
+    munmap((void*) info, page);
+
+    map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+
+    if(map == MAP_FAILED)
+        goto fail;
+
+    k = krad_attach(map, len, fd);
+
+    if(!k)
+    {
+        err = errno;
+        munmap(map, len);
+        errno = err;
+        goto fail;
+    }
+
+    k->map = map;
+    k->map_len = len;
+    return k;
+
+fail:
+    err = errno;
+    close(fd);
+    errno = err;
+    return NULL;
+}
+
+void krad_close(struct krad* k)
+{
+    if(!k)
+        return;
+
+    if(k->map)
+    {
+        munmap(k->map, k->map_len);
+        close(k->fd);
+    }
+
+    free(k);
+}
+
+int krad_fd(const struct krad* k)
+{
+    return k->fd;
+}
+
+clockid_t krad_clock(const struct krad* k)
+{
+    return k->info->clock_id;
+}
+
+uint64_t krad_lost(const struct krad* k)
+{
+    return k->lost;
+}
+
+size_t krad_peek(struct krad* k, struct krad_view* view, size_t max)
+{
+    uint32_t seq = ring_seq(k);
+    uint32_t avail = seq - k->cursor;
+    uint32_t start;
+    size_t n;
+
+    /*
+     * Pulse seq - size may be being overwritten right now, so only the
+     * newest size - 1 are safe to hand out
+     */
+    if(avail > k->size - 1)
+    {
+        k->lost += avail - (k->size - 1);
+        k->cursor = seq - (k->size - 1);
+        avail = k->size - 1;
+    }
+
+    n = avail < max ? avail : max;
+    start = k->cursor & (k->size - 1);
+
+    view->seq = k->cursor;
+    view->first = k->ring + start;
+    view->first_len = n < k->size - start ? n : k->size - start;
+    view->second = k->ring;
+    view->second_len = n - view->first_len;
+
+    return n;
+}
+
+size_t krad_release(struct krad* k, const struct krad_view* view)
+{
+    size_t n = view->first_len + view->second_len;
+    uint32_t oldest;
+    uint32_t behind;
+    size_t bad = 0;
+
+    //the pulses must be read before seq is checked again
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    //anything older than this may have been overwritten
+    oldest = ring_seq(k) - (k->size - 1);
+    behind = oldest - view->seq;
+
+    if((int32_t) behind > 0)
+        bad = behind < n ? behind : n;
+
+    k->lost += bad;
+    k->cursor = view->seq + n;
+    return bad;
+}
+
+size_t krad_read(struct krad* k, struct krad_pulse* out, size_t max)
+{
+    struct krad_view view;
+    size_t n = krad_peek(k, &view, max);
+    size_t bad;
+
+    if(!n)
+        return 0;
+
+    memcpy(out, view.first, view.first_len * sizeof(*out));
+    memcpy(out + view.first_len, view.second, view.second_len * sizeof(*out));
+
+    bad = krad_release(k, &view);
+
+    if(bad)
+        memmove(out, out + bad, (n - bad) * sizeof(*out));
+
+    return n - bad;
+}
+
+int krad_arm(struct krad* k)
+{
+    uint32_t cursor = k->cursor;
+
+    if(k->fd < 0)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    return ioctl(k->fd, KRAD_SET_CURSOR, &cursor);
+}
+
+int krad_wait(struct krad* k, int timeout_ms)
+{
+    struct pollfd p;
+    int ret;
+
+    if(ring_seq(k) != k->cursor)
+        return 1;
+
+    //a pulse that lands after the check above still wakes the poll
+    if(krad_arm(k))
+        return -1;
+
+    p.fd = k->fd;
+    p.events = POLLIN;
+
+    do
+    {
+        ret = poll(&p, 1, timeout_ms);
+    }
+    while(ret < 0 && errno == EINTR);
+
+    return ret < 0 ? -1 : ret > 0;
+}
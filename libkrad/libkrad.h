@@ -0,0 +1,110 @@
+/*
+ * libkrad, batched and zero-copy access to the pulses krad publishes on
+ * /dev/krad
+ *
+ * The library maps the device's pulse ring read-only and pulls pulses
+ * out of it in batches, without a system call per batch. Each handle
+ * keeps its own cursor. If a reader falls more than a ring's worth of
+ * pulses behind, the oldest pulses are skipped and counted as lost.
+ *
+ * A handle must not be used by more than one thread at a time.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ */
+
+#ifndef _LIBKRAD_H
+#define _LIBKRAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../krad.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct krad;
+
+/*
+ * Pulses handed out without copying. They point into the mapped ring,
+ * and wrap at its end, so there can be two runs. The pulses stay in
+ * place until the kernel laps the reader; krad_release() says whether
+ * that happened while the view was held.
+ */
+struct krad_view
+{
+    const struct krad_pulse* first;
+    size_t first_len;
+    const struct krad_pulse* second;
+    size_t second_len;
+    uint32_t seq; //sequence number of first[0]
+};
+
+/*
+ * Opens and maps the device (path NULL for /dev/krad). Reading starts
+ * with the next pulse. Returns NULL and sets errno on failure.
+ */
+struct krad* krad_open(const char* path);
+
+/*
+ * Uses an existing mapping laid out like /dev/krad's, for example a
+ * recording or a benchmark's fake ring. fd may be -1, in which case
+ * krad_wait() and krad_arm() fail with EBADF. The handle doesn't take
+ * ownership of map or fd.
+ */
+struct krad* krad_attach(const void* map, size_t len, int fd);
+
+void krad_close(struct krad* k);
+
+//for epoll and friends, see krad_arm()
+int krad_fd(const struct krad* k);
+
+//the clock_id the pulses were timestamped with
+clockid_t krad_clock(const struct krad* k);
+
+//pulses skipped or overwritten before this handle could read them
+uint64_t krad_lost(const struct krad* k);
+
+/*
+ * Returns up to max unread pulses as a view, without copying or a
+ * system call. 0 means none are waiting. The cursor doesn't move until
+ * krad_release().
+ */
+size_t krad_peek(struct krad* k, struct krad_view* view, size_t max);
+
+/*
+ * Finishes with a view from krad_peek() and moves past it. Returns how
+ * many pulses at the start of the view were overwritten while it was
+ * held. Anything the caller derived from those must be thrown away.
+ */
+size_t krad_release(struct krad* k, const struct krad_view* view);
+
+/*
+ * Copies up to max unread pulses into out, dropping any that were
+ * overwritten during the copy. Returns the number copied.
+ */
+size_t krad_read(struct krad* k, struct krad_pulse* out, size_t max);
+
+/*
+ * Tells the kernel where this handle's cursor is, so the fd polls
+ * readable only once there are unread pulses. Call it before waiting
+ * on the fd in an epoll loop. Returns 0, or -1 and sets errno.
+ */
+int krad_arm(struct krad* k);
+
+/*
+ * Waits up to timeout_ms (-1 forever) for unread pulses. Returns 1 if
+ * there are some, 0 on timeout, or -1 and sets errno.
+ */
+int krad_wait(struct krad* k, int timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,327 @@
+/*
+ * Feeds geiger counter clicks from an audio input into krad
+ *
+ * Many counters only expose a speaker or line-level click output. This
+ * captures it with ALSA, finds clicks at sample resolution, and writes
+ * their timestamps to /dev/krad (load krad with geiger_pulse_pin=-1 if
+ * there's no GPIO tube as well).
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <alsa/asoundlib.h>
+
+#include "../krad.h"
+
+#define PERIOD_FRAMES 1024
+#define MAX_CLICKS    64 //per period, a counter can't click faster than this
+#define LANES         8  //16 bit samples per 128 bit vector
+
+//SSE2 or NEON, whichever the compiler targets
+typedef int16_t v8i16 __attribute__((vector_size(16)));
+typedef int64_t v2i64 __attribute__((vector_size(16)));
+
+/*
+ * Edge detector state. A click is the first sample at or above threshold
+ * after the signal has spent holdoff samples below the rearm level, so
+ * ringing after a click isn't counted twice.
+ */
+struct detector
+{
+    int16_t threshold;
+    int16_t rearm;
+    unsigned int holdoff;
+    unsigned int quiet;
+    bool armed;
+};
+
+static bool any(v8i16 mask)
+{
+    v2i64 w = (v2i64) mask;
+
+    return (w[0] | w[1]) != 0;
+}
+
+static size_t detect_scalar(struct detector* d, const int16_t* s, size_t n, size_t base,
+                            size_t* clicks, size_t found, size_t max)
+{
+    size_t i;
+
+    for(i = 0; i < n; i++)
+    {
+        int a = abs((int) s[i]);
+
+        if(d->armed)
+        {
+            if(a >= d->threshold)
+            {
+                if(found < max)
+                    clicks[found++] = base + i;
+
+                d->armed = false;
+                d->quiet = 0;
+            }
+        }
+        else if(a < d->rearm)
+        {
+            if(++d->quiet >= d->holdoff)
+                d->armed = true;
+        }
+        else
+        {
+            d->quiet = 0;
+        }
+    }
+
+    return found;
+}
+
+/*
+ * Finds clicks in n samples, storing their indices in clicks. Most vectors
+ * are settled with two compares: while armed, a vector with nothing at the
+ * threshold is skipped, and while disarmed, a vector entirely below the
+ * rearm level just adds to the quiet count. Only vectors with a click or
+ * ringing in them are walked sample by sample.
+ */
+static size_t detect(struct detector* d, const int16_t* s, size_t n, size_t* clicks, size_t max)
+{
+    v8i16 hi = (v8i16) {0} + d->threshold;
+    v8i16 rhi = (v8i16) {0} + d->rearm;
+    v8i16 lo = -hi;
+    v8i16 rlo = -rhi;
+    size_t found = 0;
+    size_t i;
+
+    for(i = 0; i + LANES <= n; i += LANES)
+    {
+        v8i16 v;
+
+        memcpy(&v, s + i, sizeof(v));
+
+        if(d->armed)
+        {
+            if(!any((v >= hi) | (v <= lo)))
+                continue;
+        }
+        else if(!any((v >= rhi) | (v <= rlo)))
+        {
+            //everything in this vector is quiet, rearm as soon as allowed
+            d->quiet += LANES;
+
+            if(d->quiet >= d->holdoff)
+                d->armed = true;
+
+            continue;
+        }
+
+        found = detect_scalar(d, s + i, LANES, i, clicks, found, max);
+    }
+
+    return detect_scalar(d, s + i, n - i, i, clicks, found, max);
+}
+
+static int64_t ts_ns(const struct timespec* t)
+{
+    return (int64_t) t->tv_sec * 1000000000LL + t->tv_nsec;
+}
+
+//the clock krad is stamping pulses with
+static clockid_t krad_clock(void)
+{
+    FILE* f = fopen("/sys/module/krad/parameters/clock_id", "r");
+    int id = CLOCK_REALTIME;
+
+    if(f)
+    {
+        if(fscanf(f, "%d", &id) != 1)
+            id = CLOCK_REALTIME;
+
+        fclose(f);
+    }
+
+    return (clockid_t) id;
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr,
+            "usage: %s [-D device] [-r rate] [-t threshold] [-H holdoff_us] [-n]\n"
+            "  -D  ALSA capture device (default \"default\")\n"
+            "  -r  sample rate in Hz (default 48000)\n"
+            "  -t  click threshold, 1-32767 (default 8000)\n"
+            "  -H  quiet time before the next click, in microseconds (default 200)\n"
+            "  -n  print clicks instead of writing them to /dev/krad\n",
+            name);
+}
+
+int main(int argc, char** argv)
+{
+    const char* device = "default";
+    unsigned int rate = 48000;
+    unsigned int holdoff_us = 200;
+    int threshold = 8000;
+    bool dry_run = false;
+    struct detector d;
+    snd_pcm_t* pcm;
+    snd_pcm_sw_params_t* sw;
+    clockid_t clock;
+    int fd = -1;
+    int opt;
+    int ret;
+
+    while((opt = getopt(argc, argv, "D:r:t:H:n")) != -1)
+    {
+        switch(opt)
+        {
+            case 'D': device = optarg; break;
+            case 'r': rate = strtoul(optarg, NULL, 0); break;
+            case 't': threshold = atoi(optarg); break;
+            case 'H': holdoff_us = strtoul(optarg, NULL, 0); break;
+            case 'n': dry_run = true; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if(!rate || threshold < 1 || threshold > 32767)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    d.threshold = threshold;
+    d.rearm = threshold / 2;
+    d.holdoff = (unsigned int) ((uint64_t) holdoff_us * rate / 1000000);
+    d.quiet = 0;
+    d.armed = false;
+
+    clock = krad_clock();
+
+    if(!dry_run)
+    {
+        fd = open("/dev/krad", O_WRONLY);
+
+        if(fd < 0)
+        {
+            perror("kradaudio: /dev/krad");
+            return 1;
+        }
+    }
+
+    ret = snd_pcm_open(&pcm, device, SND_PCM_STREAM_CAPTURE, 0);
+
+    if(ret < 0)
+    {
+        fprintf(stderr, "kradaudio: can't open %s: %s\n", device, snd_strerror(ret));
+        return 1;
+    }
+
+    ret = snd_pcm_set_params(pcm, SND_PCM_FORMAT_S16, SND_PCM_ACCESS_RW_INTERLEAVED,
+                             1, rate, 1, 100000);
+
+    if(ret < 0)
+    {
+        fprintf(stderr, "kradaudio: can't set up %s: %s\n", device, snd_strerror(ret));
+        return 1;
+    }
+
+    //timestamp the hardware pointer with a clock that never jumps
+    snd_pcm_sw_params_alloca(&sw);
+    snd_pcm_sw_params_current(pcm, sw);
+    snd_pcm_sw_params_set_tstamp_mode(pcm, sw, SND_PCM_TSTAMP_ENABLE);
+    snd_pcm_sw_params_set_tstamp_type(pcm, sw, SND_PCM_TSTAMP_TYPE_MONOTONIC_RAW);
+    ret = snd_pcm_sw_params(pcm, sw);
+
+    if(ret < 0)
+    {
+        fprintf(stderr, "kradaudio: can't enable timestamps on %s: %s\n", device, snd_strerror(ret));
+        return 1;
+    }
+
+    for(;;)
+    {
+        int16_t samples[PERIOD_FRAMES];
+        size_t clicks[MAX_CLICKS];
+        struct krad_pulse pulses[MAX_CLICKS];
+        snd_pcm_uframes_t avail;
+        snd_htimestamp_t hw_time;
+        struct timespec now_krad;
+        struct timespec now_raw;
+        snd_pcm_sframes_t n;
+        int64_t offset;
+        size_t found;
+        size_t c;
+
+        n = snd_pcm_readi(pcm, samples, PERIOD_FRAMES);
+
+        if(n < 0)
+        {
+            n = snd_pcm_recover(pcm, n, 0);
+
+            if(n < 0)
+            {
+                fprintf(stderr, "kradaudio: capture failed: %s\n", snd_strerror(n));
+                return 1;
+            }
+
+            continue;
+        }
+
+        found = detect(&d, samples, n, clicks, MAX_CLICKS);
+
+        if(!found)
+            continue;
+
+        /*
+         * hw_time is when the newest captured frame arrived, and avail
+         * frames have arrived since the last one we read. Map it from
+         * MONOTONIC_RAW onto krad's clock with a fresh offset each period.
+         */
+        if(snd_pcm_htimestamp(pcm, &avail, &hw_time) < 0)
+            continue;
+
+        clock_gettime(CLOCK_MONOTONIC_RAW, &now_raw);
+        clock_gettime(clock, &now_krad);
+        offset = ts_ns(&now_krad) - ts_ns(&now_raw);
+
+        for(c = 0; c < found; c++)
+        {
+            int64_t age = (int64_t) (n - 1 - clicks[c]) + avail;
+            int64_t t = ts_ns(&hw_time) + offset - age * 1000000000LL / rate;
+
+            pulses[c].tv_sec = t / 1000000000LL;
+            pulses[c].tv_nsec = t % 1000000000LL;
+
+            if(dry_run)
+                printf("%lld.%09lld\n", (long long) pulses[c].tv_sec, (long long) pulses[c].tv_nsec);
+        }
+
+        if(dry_run)
+        {
+            fflush(stdout);
+        }
+        else if(write(fd, pulses, found * sizeof(struct krad_pulse)) < 0)
+        {
+            perror("kradaudio: write");
+            return 1;
+        }
+    }
+}